@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <pthread.h>
+#include <reader.h>
+#include <sched.h>
+#include <smart_ob.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Batch replay of many capture files, one SmartL3Book per file, scheduled on
+// a work-stealing thread pool with one (optionally pinned) worker per core.
+// Each file is streamed line by line, never loaded whole.
+
+// counts the callbacks and the estimated qty they carry
+struct StatsCallback : SmartObCallback {
+    void onOrderAdd(const SmartL3Book &, const OrderInfo &) override {
+        adds++;
+    }
+    void onOrderCancel(const SmartL3Book &, const OrderInfo &info) override {
+        cancels++;
+        cancel_qty += info.size;
+    }
+    void onOrderModify(const SmartL3Book &, const OrderInfo &) override {
+        modifies++;
+    }
+    void onOrderExecution(const SmartL3Book &,
+                          const OrderInfo &info) override {
+        executions++;
+        exec_qty += info.size;
+    }
+
+    uint64_t adds = 0, cancels = 0, modifies = 0, executions = 0;
+    int64_t exec_qty = 0, cancel_qty = 0;
+};
+
+// power of two buckets, bucket b counts latencies in [2^(b-1), 2^b) ns
+struct LatencyHistogram {
+    void Add(uint64_t ns) {
+        buckets[ns ? 64 - __builtin_clzll(ns) : 0]++;
+        count++;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+    }
+
+    void Merge(const LatencyHistogram &o) {
+        for (size_t b = 0; b < buckets.size(); b++)
+            buckets[b] += o.buckets[b];
+        count += o.count;
+        total_ns += o.total_ns;
+        max_ns = std::max(max_ns, o.max_ns);
+    }
+
+    // upper bound of the bucket holding the q quantile
+    uint64_t Quantile(double q) const {
+        uint64_t rank = static_cast<uint64_t>(q * count), seen = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+            seen += buckets[b];
+            if (seen > rank)
+                return b ? std::min(max_ns, (uint64_t{1} << b) - 1) : 0;
+        }
+        return max_ns;
+    }
+
+    double AvgNs() const { return count ? double(total_ns) / count : 0; }
+
+    std::array<uint64_t, 65> buckets{};
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+};
+
+struct ReplayResult {
+    std::string path;
+    std::string error;
+    uint64_t messages = 0;
+    uint64_t adds = 0, cancels = 0, modifies = 0, executions = 0;
+    int64_t exec_qty = 0, cancel_qty = 0;
+    // per message, book update including its callbacks
+    LatencyHistogram latency;
+
+    void Merge(const ReplayResult &o) {
+        messages += o.messages;
+        adds += o.adds;
+        cancels += o.cancels;
+        modifies += o.modifies;
+        executions += o.executions;
+        exec_qty += o.exec_qty;
+        cancel_qty += o.cancel_qty;
+        latency.Merge(o.latency);
+    }
+};
+
+inline ReplayResult ReplayFile(const std::string &path) {
+    ReplayResult result;
+    result.path = path;
+    std::ifstream input(path);
+    if (!input.is_open()) {
+        result.error = "cannot open";
+        return result;
+    }
+
+    StatsCallback cb;
+    SmartL3Book book(&cb);
+    StreamMsg msg;
+    while (ReadMessage(input, msg)) {
+        auto t0 = std::chrono::steady_clock::now();
+        Dispatch(book, msg);
+        auto t1 = std::chrono::steady_clock::now();
+        result.latency.Add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)
+                .count());
+        result.messages++;
+    }
+
+    result.adds = cb.adds;
+    result.cancels = cb.cancels;
+    result.modifies = cb.modifies;
+    result.executions = cb.executions;
+    result.exec_qty = cb.exec_qty;
+    result.cancel_qty = cb.cancel_qty;
+    return result;
+}
+
+// one path per line, blank lines and '#' comments skipped
+inline std::vector<std::string> ReadManifest(std::istream &input) {
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline(input, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty() && line[0] != '#')
+            paths.push_back(line);
+    }
+    return paths;
+}
+
+// the cores of the process' affinity mask, e.g. a restricted cpuset in a
+// container or taskset, empty if it cannot be read
+inline std::vector<int> AllowedCores() {
+    std::vector<int> cores;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cores;
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &set))
+            cores.push_back(c);
+    return cores;
+}
+
+// Fixed set of independent tasks run by `threads` workers. Each worker owns a
+// deque, takes from its back and, once empty, steals from the front of the
+// others, so long files do not leave the rest of the cores idle.
+struct WorkStealingPool {
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(unsigned threads, bool pin = false)
+        : pin(pin), queues(std::max(1u, threads)) {}
+
+    // round robin, before Run
+    void Submit(Task task) {
+        auto &q = queues[next_queue++ % queues.size()];
+        q.tasks.push_back(std::move(task));
+    }
+
+    // runs every submitted task and returns once they are all done
+    void Run() {
+        if (pin)
+            cores = AllowedCores();
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < queues.size(); w++)
+            workers.emplace_back([this, w] { Work(w); });
+        for (auto &t : workers)
+            t.join();
+    }
+
+    uint64_t Steals() const { return steals.load(); }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool Pop(size_t w, Task &task) {
+        auto &q = queues[w];
+        std::lock_guard lock(q.mutex);
+        if (q.tasks.empty())
+            return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool Steal(size_t w, Task &task) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            auto &q = queues[(w + i) % queues.size()];
+            std::lock_guard lock(q.mutex);
+            if (q.tasks.empty())
+                continue;
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            steals++;
+            return true;
+        }
+        return false;
+    }
+
+    void Work(size_t w) {
+        if (pin)
+            PinToCore(w);
+        Task task;
+        // tasks never submit tasks, so empty everywhere means done
+        while (Pop(w, task) || Steal(w, task))
+            task();
+    }
+
+    // worker w takes the w-th core the process may run on
+    void PinToCore(size_t w) const {
+        if (cores.empty())
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cores[w % cores.size()], &set);
+        // best effort
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    bool pin;
+    std::vector<int> cores;
+    std::deque<Queue> queues;
+    size_t next_queue = 0;
+    std::atomic<uint64_t> steals{0};
+};
+
+struct BatchReport {
+    std::vector<ReplayResult> files;
+    ReplayResult total;
+    uint64_t failed = 0;
+    uint64_t steals = 0;
+    double wall_seconds = 0;
+
+    void Print(std::ostream &os) const {
+        char line[256];
+        for (const auto &r : files) {
+            if (!r.error.empty()) {
+                os << r.path << ": " << r.error << "\n";
+                continue;
+            }
+            std::snprintf(line, sizeof(line),
+                          "%s: messages %llu exec_qty %lld cancel_qty %lld "
+                          "avg %.0f ns\n",
+                          r.path.c_str(),
+                          static_cast<unsigned long long>(r.messages),
+                          static_cast<long long>(r.exec_qty),
+                          static_cast<long long>(r.cancel_qty),
+                          r.latency.AvgNs());
+            os << line;
+        }
+        const auto &t = total;
+        std::snprintf(
+            line, sizeof(line),
+            "files %zu failed %llu messages %llu in %.3f s (%.0f msg/s), "
+            "steals %llu\n",
+            files.size(), static_cast<unsigned long long>(failed),
+            static_cast<unsigned long long>(t.messages), wall_seconds,
+            wall_seconds > 0 ? t.messages / wall_seconds : 0.0,
+            static_cast<unsigned long long>(steals));
+        os << line;
+        std::snprintf(line, sizeof(line),
+                      "callbacks add %llu cancel %llu modify %llu execution "
+                      "%llu, exec_qty %lld cancel_qty %lld\n",
+                      static_cast<unsigned long long>(t.adds),
+                      static_cast<unsigned long long>(t.cancels),
+                      static_cast<unsigned long long>(t.modifies),
+                      static_cast<unsigned long long>(t.executions),
+                      static_cast<long long>(t.exec_qty),
+                      static_cast<long long>(t.cancel_qty));
+        os << line;
+        std::snprintf(line, sizeof(line),
+                      "latency avg %.0f ns p50 <%llu ns p99 <%llu ns max "
+                      "%llu ns\n",
+                      t.latency.AvgNs(),
+                      static_cast<unsigned long long>(t.latency.Quantile(0.5)),
+                      static_cast<unsigned long long>(t.latency.Quantile(0.99)),
+                      static_cast<unsigned long long>(t.latency.max_ns));
+        os << line;
+    }
+};
+
+// threads = 0 uses one worker per core the process may run on
+inline BatchReport RunBatch(const std::vector<std::string> &paths,
+                            unsigned threads = 0, bool pin = true) {
+    if (!threads)
+        threads = std::max<unsigned>(1, AllowedCores().size());
+    threads = std::min<unsigned>(threads, std::max<size_t>(1, paths.size()));
+
+    BatchReport report;
+    report.files.resize(paths.size());
+    WorkStealingPool pool(threads, pin);
+    for (size_t i = 0; i < paths.size(); i++) {
+        pool.Submit([&report, &paths, i] {
+            report.files[i] = ReplayFile(paths[i]);
+        });
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    pool.Run();
+    report.wall_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+            .count();
+
+    for (const auto &r : report.files) {
+        if (r.error.empty())
+            report.total.Merge(r);
+        else
+            report.failed++;
+    }
+    report.steals = pool.Steals();
+    return report;
+}
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <algorithm>
+#include <callback.h>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <reader.h>
+#include <smart_ob.h>
+#include <string>
+#include <vector>
+
+// Differential fuzzing of book engines.
+//
+// GenerateWorkload simulates an exchange book and emits its three streams:
+// one L3 message per event, an L2 snapshot of the true book every few events
+// and a trade per execution, then interleaves them with random delays while
+// each stream stays in seq_id order. RunLockstep feeds a workload to a
+// reference engine and to candidate engines, and after each message their
+// callbacks and rendered books (the estimated orders of every level) must be
+// identical. A failing workload is shrunk to a minimal one that still fails,
+// and printed in the capture format so it replays with smart_ob.
+
+struct FuzzConfig {
+    uint64_t seed = 1;
+    // L3 events, snapshots and trades come on top
+    size_t num_events = 1000;
+    // price levels per side
+    int num_levels = 8;
+    int max_orders = 64;
+    // one snapshot every n events on average
+    int snapshot_every = 8;
+    // max delay of a message behind its stream, in messages
+    int max_delay = 3;
+    // L3 only workloads for books without these streams
+    bool l2_stream = true;
+    bool trade_stream = true;
+};
+
+inline std::vector<StreamMsg> GenerateWorkload(const FuzzConfig &config) {
+    struct Live {
+        Order order;
+        // queue position, modifies go to the back like the default
+        // ModifyPriority::LoseAlways
+        uint64_t time;
+    };
+    struct Timed {
+        size_t arrival;
+        StreamMsg msg;
+    };
+
+    std::mt19937_64 rng(config.seed);
+    auto uniform = [&rng](int n) { return static_cast<int>(rng() % n); };
+    // exact same double for the same level
+    auto level_price = [](bool is_bid, int k) {
+        return is_bid ? (9999 - k) / 100.0 : (10000 + k) / 100.0;
+    };
+
+    std::map<int, Live> live;
+    std::vector<Timed> out;
+    size_t last_arrival[3] = {0, 0, 0};
+    auto emit = [&](int stream, StreamMsg msg) {
+        auto arrival = out.size() + uniform(config.max_delay + 1);
+        arrival = std::max(arrival, last_arrival[stream]);
+        last_arrival[stream] = arrival;
+        out.push_back(Timed{arrival, std::move(msg)});
+    };
+
+    int seq_id = 0, next_id = 1;
+    uint64_t time = 0;
+    auto random_live = [&]() -> Live & {
+        return std::next(live.begin(), uniform(live.size()))->second;
+    };
+
+    for (size_t e = 0; e < config.num_events; e++) {
+        seq_id++;
+        int r = uniform(100);
+        if (live.empty() ||
+            (r < 40 && static_cast<int>(live.size()) < config.max_orders)) {
+            bool is_bid = uniform(2);
+            Order o{next_id++, is_bid, 1 + uniform(20),
+                    level_price(is_bid, uniform(config.num_levels))};
+            live[o.orderId] = Live{o, time++};
+            emit(0, Level3{seq_id, level3::Add{o.orderId, o.is_buy, o.size,
+                                               o.price}});
+        } else if (r < 60) {
+            auto &l = random_live();
+            int size = 1 + uniform(20);
+            double price = uniform(2) ? l.order.price
+                                      : level_price(l.order.is_buy,
+                                                    uniform(config.num_levels));
+            emit(0, Level3{seq_id, level3::Modify{l.order.orderId,
+                                                  l.order.is_buy, size,
+                                                  price}});
+            l.order.size = size;
+            l.order.price = price;
+            l.time = time++;
+        } else if (r < 80) {
+            auto o = random_live().order;
+            emit(0, Level3{seq_id, level3::Cancel{o.orderId, o.is_buy}});
+            live.erase(o.orderId);
+        } else {
+            // the front order of the best level of a random side
+            bool is_bid = uniform(2);
+            Live *front = nullptr;
+            for (auto &[id, l] : live) {
+                if (l.order.is_buy != is_bid)
+                    continue;
+                if (!front || (is_bid ? l.order.price > front->order.price
+                                      : l.order.price < front->order.price) ||
+                    (l.order.price == front->order.price &&
+                     l.time < front->time))
+                    front = &l;
+            }
+            if (!front) {
+                seq_id--;
+                continue;
+            }
+            auto o = front->order;
+            int size = 1 + uniform(o.size);
+            emit(0, Level3{seq_id, level3::Execute{o.orderId, is_bid, size}});
+            if (config.trade_stream)
+                emit(2, Trade{seq_id, is_bid, o.price, size});
+            if ((front->order.size -= size) == 0)
+                live.erase(o.orderId);
+        }
+
+        if (config.l2_stream && uniform(config.snapshot_every) == 0) {
+            std::map<double, int, BidComparator> bids;
+            std::map<double, int, AskComparator> asks;
+            for (auto &[id, l] : live)
+                (l.order.is_buy ? bids[l.order.price] : asks[l.order.price]) +=
+                    l.order.size;
+            Snapshot s{++seq_id, {}, {}};
+            for (auto &[p, q] : bids)
+                s.bids.push_back(L2PriceLevel{p, q});
+            for (auto &[p, q] : asks)
+                s.asks.push_back(L2PriceLevel{p, q});
+            emit(1, std::move(s));
+        }
+    }
+
+    std::stable_sort(out.begin(), out.end(),
+                     [](const Timed &a, const Timed &b) {
+                         return a.arrival < b.arrival;
+                     });
+    std::vector<StreamMsg> msgs;
+    msgs.reserve(out.size());
+    for (auto &t : out)
+        msgs.push_back(std::move(t.msg));
+    return msgs;
+}
+
+// the L3 stream never refers to an order in a way the books assert on: no
+// duplicate adds, sides match and executions do not exceed the order. used
+// to keep shrunk workloads meaningful
+inline bool IsValidWorkload(const std::vector<StreamMsg> &msgs) {
+    std::map<int, Order> live;
+    for (const auto &msg : msgs) {
+        auto *l3 = std::get_if<Level3>(&msg);
+        if (!l3)
+            continue;
+        bool ok = std::visit(
+            [&live](auto &&m) {
+                using M = std::decay_t<decltype(m)>;
+                auto it = live.find(m.order_id);
+                bool found = it != live.end();
+                if (found && it->second.is_buy != m.is_buy)
+                    return false;
+                if constexpr (std::is_same_v<M, level3::Add>) {
+                    if (found)
+                        return false;
+                    live[m.order_id] = Order{m.order_id, m.is_buy, m.size,
+                                             m.price};
+                } else if constexpr (std::is_same_v<M, level3::Modify>) {
+                    if (m.size)
+                        live[m.order_id] = Order{m.order_id, m.is_buy, m.size,
+                                                 m.price};
+                    else if (found)
+                        live.erase(it);
+                } else if constexpr (std::is_same_v<M, level3::Cancel>) {
+                    if (found)
+                        live.erase(it);
+                } else if (found) {
+                    if (m.size > it->second.size)
+                        return false;
+                    if ((it->second.size -= m.size) == 0)
+                        live.erase(it);
+                }
+                return true;
+            },
+            l3->msg);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+struct RecordedCallback {
+    // 'A'dd, 'C'ancel, 'M'odify or 'E'xecution
+    char kind;
+    OrderInfo info;
+
+    bool operator==(const RecordedCallback &o) const {
+        return kind == o.kind && info.order_id == o.info.order_id &&
+               info.is_buy == o.info.is_buy && info.size == o.info.size &&
+               info.price == o.info.price;
+    }
+};
+
+template <typename Book>
+struct CallbackRecorder : SmartObCallbackT<Book> {
+    void onOrderAdd(const Book &, const OrderInfo &info) override {
+        events.push_back(RecordedCallback{'A', info});
+    }
+    void onOrderCancel(const Book &, const OrderInfo &info) override {
+        events.push_back(RecordedCallback{'C', info});
+    }
+    void onOrderModify(const Book &, const OrderInfo &info) override {
+        events.push_back(RecordedCallback{'M', info});
+    }
+    void onOrderExecution(const Book &, const OrderInfo &info) override {
+        events.push_back(RecordedCallback{'E', info});
+    }
+
+    std::vector<RecordedCallback> events;
+};
+
+// one book implementation under test
+struct BookEngine {
+    virtual ~BookEngine() = default;
+
+    virtual void Apply(const StreamMsg &msg) = 0;
+    // callbacks of the messages applied since the last Clear
+    virtual const std::vector<RecordedCallback> &Callbacks() const = 0;
+    virtual void Clear() = 0;
+    virtual void Render(std::string &out) const = 0;
+};
+
+template <typename Book = SmartL3Book> struct SmartBookEngine : BookEngine {
+    explicit SmartBookEngine(std::function<void(Book &)> configure = {})
+        : book(&recorder) {
+        if (configure)
+            configure(book);
+    }
+
+    void Apply(const StreamMsg &msg) override { Dispatch(book, msg); }
+    const std::vector<RecordedCallback> &Callbacks() const override {
+        return recorder.events;
+    }
+    void Clear() override { recorder.events.clear(); }
+    void Render(std::string &out) const override { book.Render(out); }
+
+    CallbackRecorder<Book> recorder;
+    Book book;
+};
+
+struct NamedEngine {
+    std::string name;
+    std::function<std::unique_ptr<BookEngine>()> make;
+};
+
+inline void AppendCallbacks(std::string &out,
+                            const std::vector<RecordedCallback> &events) {
+    for (const auto &e : events) {
+        out += e.kind;
+        out += ' ';
+        AppendInt(out, e.info.order_id);
+        out += e.info.is_buy ? " B " : " S ";
+        AppendInt(out, e.info.size);
+        out += '@';
+        AppendPrice(out, e.info.price);
+        out += '\n';
+    }
+}
+
+struct FuzzMismatch {
+    // index of the first message after which the engines differ
+    size_t index = 0;
+    std::string engine;
+    // callbacks of that message and the book after it
+    std::string expected, actual;
+};
+
+// true if every candidate matches the reference after every message
+inline bool RunLockstep(const NamedEngine &reference,
+                        const std::vector<NamedEngine> &candidates,
+                        const std::vector<StreamMsg> &msgs,
+                        FuzzMismatch *mismatch = nullptr) {
+    auto ref = reference.make();
+    std::vector<std::unique_ptr<BookEngine>> engines;
+    for (const auto &c : candidates)
+        engines.push_back(c.make());
+
+    std::string ref_book, book;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        ref->Clear();
+        ref->Apply(msgs[i]);
+        ref->Render(ref_book);
+        for (size_t c = 0; c < engines.size(); c++) {
+            auto &engine = *engines[c];
+            engine.Clear();
+            engine.Apply(msgs[i]);
+            engine.Render(book);
+            if (engine.Callbacks() == ref->Callbacks() && book == ref_book)
+                continue;
+            if (mismatch) {
+                mismatch->index = i;
+                mismatch->engine = candidates[c].name;
+                mismatch->expected.clear();
+                AppendCallbacks(mismatch->expected, ref->Callbacks());
+                mismatch->expected += ref_book;
+                mismatch->actual.clear();
+                AppendCallbacks(mismatch->actual, engine.Callbacks());
+                mismatch->actual += book;
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// removes messages while the workload stays valid and still fails, in
+// chunks of half the workload first, down to single messages
+inline std::vector<StreamMsg>
+Shrink(const NamedEngine &reference, const std::vector<NamedEngine> &candidates,
+       std::vector<StreamMsg> msgs) {
+    FuzzMismatch mismatch;
+    if (RunLockstep(reference, candidates, msgs, &mismatch))
+        return msgs;
+    // nothing after the first mismatch matters
+    msgs.resize(mismatch.index + 1);
+
+    auto fails = [&](const std::vector<StreamMsg> &m) {
+        return IsValidWorkload(m) && !RunLockstep(reference, candidates, m);
+    };
+    size_t chunk = std::max<size_t>(1, msgs.size() / 2);
+    while (true) {
+        bool removed = false;
+        for (size_t start = 0; start < msgs.size();) {
+            auto trial = msgs;
+            trial.erase(trial.begin() + start,
+                        trial.begin() + std::min(start + chunk, trial.size()));
+            if (!trial.empty() && fails(trial)) {
+                msgs = std::move(trial);
+                removed = true;
+            } else {
+                start += chunk;
+            }
+        }
+        if (removed)
+            chunk = std::min(chunk, std::max<size_t>(1, msgs.size() / 2));
+        else if (chunk == 1)
+            break;
+        else
+            chunk /= 2;
+    }
+    return msgs;
+}
+
+struct EngineThroughput {
+    std::string name;
+    double msgs_per_sec = 0;
+    // msgs_per_sec over the reference's
+    double relative = 0;
+};
+
+// best of `repeats` full replays of the workload on a fresh engine, the
+// first engine is the reference
+inline std::vector<EngineThroughput>
+MeasureThroughput(const std::vector<NamedEngine> &engines,
+                  const std::vector<StreamMsg> &msgs, int repeats = 3) {
+    std::vector<EngineThroughput> result;
+    for (const auto &e : engines) {
+        double best = 0;
+        for (int r = 0; r < repeats; r++) {
+            auto engine = e.make();
+            auto t0 = std::chrono::steady_clock::now();
+            for (const auto &msg : msgs) {
+                engine->Clear();
+                engine->Apply(msg);
+            }
+            double s = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0)
+                           .count();
+            if (s > 0)
+                best = std::max(best, msgs.size() / s);
+        }
+        result.push_back(EngineThroughput{e.name, best, 0});
+    }
+    for (auto &t : result)
+        t.relative = result[0].msgs_per_sec > 0
+                         ? t.msgs_per_sec / result[0].msgs_per_sec
+                         : 0;
+    return result;
+}
+
+struct FuzzReport {
+    uint64_t workloads = 0;
+    uint64_t messages = 0;
+    bool failed = false;
+    uint64_t failing_seed = 0;
+    // first mismatch of the shrunk workload
+    FuzzMismatch mismatch;
+    std::vector<StreamMsg> repro;
+    std::vector<EngineThroughput> throughput;
+
+    void Print(std::ostream &os) const {
+        os << "workloads: " << workloads << " messages: " << messages << "\n";
+        for (const auto &t : throughput)
+            os << t.name << ": " << static_cast<uint64_t>(t.msgs_per_sec)
+               << " msg/s (" << t.relative << "x)\n";
+        if (!failed) {
+            os << "no mismatch\n";
+            return;
+        }
+        os << "mismatch in " << mismatch.engine << " with seed "
+           << failing_seed << " after message " << mismatch.index
+           << " of the shrunk workload:\n";
+        for (const auto &msg : repro)
+            os << FormatMessage(msg) << "\n";
+        os << "expected:\n"
+           << mismatch.expected << "actual:\n"
+           << mismatch.actual;
+    }
+};
+
+// runs `workloads` workloads with consecutive seeds until one fails, then
+// shrinks it. the throughput is measured on the first workload
+inline FuzzReport RunFuzz(FuzzConfig config, size_t workloads,
+                          const NamedEngine &reference,
+                          const std::vector<NamedEngine> &candidates) {
+    FuzzReport report;
+    auto first_seed = config.seed;
+    for (size_t w = 0; w < workloads; w++) {
+        config.seed = first_seed + w;
+        auto msgs = GenerateWorkload(config);
+        if (!w) {
+            std::vector<NamedEngine> all{reference};
+            all.insert(all.end(), candidates.begin(), candidates.end());
+            report.throughput = MeasureThroughput(all, msgs);
+        }
+        report.workloads++;
+        report.messages += msgs.size();
+        if (RunLockstep(reference, candidates, msgs))
+            continue;
+        report.failed = true;
+        report.failing_seed = config.seed;
+        report.repro = Shrink(reference, candidates, std::move(msgs));
+        RunLockstep(reference, candidates, report.repro, &report.mismatch);
+        break;
+    }
+    return report;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <ob.h>
+#include <smart_ob.h>
+#include <string>
+#include <vector>
+
+// Versioned history of the estimated book, for as-of-seq_id queries.
+//
+// The streams are not ordered by seq_id against each other, so each applied
+// update is versioned with the highest seq_id the book has seen so far. The
+// state "as of N" is the estimated book after the last update whose version
+// is <= N.
+//
+// Every update appends the new estimated orders of the levels it touched to
+// a change log, and every `checkpoint_every` updates a compact checkpoint of
+// the whole estimated book is taken. A query starts from the nearest
+// checkpoint at or before N and replays the log from there, so it costs the
+// distance to that checkpoint, not the distance to the start of the day.
+// When the history exceeds `memory_budget` bytes, the oldest checkpoint and
+// the log before the next one are dropped.
+
+struct HistOrder {
+    int order_id;
+    int size;
+};
+
+// an estimated book rebuilt from the history
+struct HistoricalBook {
+    int version = 0;
+    OneSideBook<std::vector<HistOrder>, BidComparator> bids;
+    OneSideBook<std::vector<HistOrder>, AskComparator> asks;
+
+    // same format as SmartL3Book::ToString
+    std::string ToString() const {
+        std::string out = "BID:\n";
+        for (const auto &[price, orders] : bids)
+            RenderLevel(out, true, price, orders);
+        out += "ASK:\n";
+        for (const auto &[price, orders] : asks)
+            RenderLevel(out, false, price, orders);
+        return out;
+    }
+
+    void Set(bool is_bid, double price, const HistOrder *orders, size_t n) {
+        if (is_bid)
+            SetSide(bids, price, orders, n);
+        else
+            SetSide(asks, price, orders, n);
+    }
+
+  private:
+    template <typename Side>
+    static void SetSide(Side &side, double price, const HistOrder *orders,
+                        size_t n) {
+        if (!n) {
+            side.erase(price);
+            return;
+        }
+        side[price].assign(orders, orders + n);
+    }
+
+    static void RenderLevel(std::string &out, bool is_bid, double price,
+                            const std::vector<HistOrder> &orders) {
+        AppendLevel(out, price, [&](auto &&f) {
+            for (const auto &o : orders)
+                f(Order{o.order_id, is_bid, o.size, price});
+        });
+        out += '\n';
+    }
+};
+
+template <typename Book> struct BookHistoryT : SmartObObserverT<Book> {
+    // memory_budget = 0 keeps everything
+    explicit BookHistoryT(uint64_t checkpoint_every = 1024,
+                          size_t memory_budget = 0)
+        : checkpoint_every(checkpoint_every), memory_budget(memory_budget) {}
+
+    // starts recording the book, with a checkpoint of its current state
+    void Attach(Book &book) {
+        version = std::max(version, book.CurrentSeqId());
+        TakeCheckpoint(book);
+        book.AddObserver(this);
+    }
+
+    void onUpdate(const Book &book) override {
+        version = std::max(version, book.CurrentSeqId());
+        // each touched level is listed once
+        for (const auto &ref : book.TouchedLevels())
+            LogLevel(book, ref);
+        if (++updates_since_checkpoint >= checkpoint_every)
+            TakeCheckpoint(book);
+        Trim();
+    }
+
+    // the estimated book as of seq_id N, false if N is older than the history
+    bool AsOf(int seq_id, HistoricalBook &out) const {
+        // last checkpoint with version <= seq_id
+        auto it = std::upper_bound(
+            checkpoints.begin(), checkpoints.end(), seq_id,
+            [](int v, const Checkpoint &c) { return v < c.version; });
+        if (it == checkpoints.begin())
+            return false;
+        const auto &cp = *--it;
+
+        out.bids.clear();
+        out.asks.clear();
+        out.version = cp.version;
+        for (const auto &l : cp.levels)
+            out.Set(l.is_bid, l.price, cp.orders.data() + l.first_order,
+                    l.num_orders);
+
+        for (auto i = cp.log_end; i < log_base + log.size(); i++) {
+            const auto &e = log[i - log_base];
+            if (e.version > seq_id)
+                break;
+            ApplyEntry(e, out);
+            out.version = e.version;
+        }
+        return true;
+    }
+
+    // calls f(version, const HistOrder *orders, size_t n) for each change of
+    // one level still in the history, oldest first. n = 0 means the level
+    // was removed or had no estimated orders
+    template <typename Func>
+    void LevelHistory(bool is_bid, double price, Func &&f) const {
+        auto it = level_index.find(LevelKey{is_bid, price});
+        if (it == level_index.end())
+            return;
+        const auto &entries = it->second.entries;
+        for (auto j = it->second.head; j < entries.size(); j++) {
+            const auto &e = log[entries[j] - log_base];
+            f(e.version, PoolOrders(e), static_cast<size_t>(e.num_orders));
+        }
+    }
+
+    // oldest seq_id AsOf can answer
+    int OldestVersion() const {
+        return checkpoints.empty() ? 0 : checkpoints.front().version;
+    }
+
+    // approximate, counts the log, the whole capacity of the order pool and
+    // of the index containers, and the checkpoints
+    size_t MemoryUsage() const {
+        return bytes + pool.capacity() * sizeof(HistOrder) +
+               index_slots * sizeof(uint64_t);
+    }
+
+    size_t NumCheckpoints() const { return checkpoints.size(); }
+
+    uint64_t checkpoint_every;
+    size_t memory_budget;
+
+  private:
+    struct LevelKey {
+        bool is_bid;
+        double price;
+        bool operator<(const LevelKey &o) const {
+            return is_bid != o.is_bid ? is_bid < o.is_bid : price < o.price;
+        }
+    };
+
+    // global log indices of the entries of one level, the ones before head
+    // were trimmed
+    struct LevelEntries {
+        std::vector<uint64_t> entries;
+        size_t head = 0;
+    };
+
+    struct Entry {
+        int version;
+        bool is_bid;
+        double price;
+        // orders in pool, as global indices
+        uint64_t first_order;
+        uint32_t num_orders;
+    };
+
+    struct CheckpointLevel {
+        bool is_bid;
+        double price;
+        uint32_t first_order;
+        uint32_t num_orders;
+    };
+
+    struct Checkpoint {
+        int version;
+        // global index of the first log entry after the checkpoint
+        uint64_t log_end;
+        std::vector<CheckpointLevel> levels;
+        std::vector<HistOrder> orders;
+
+        size_t Bytes() const {
+            return sizeof(Checkpoint) +
+                   levels.capacity() * sizeof(CheckpointLevel) +
+                   orders.capacity() * sizeof(HistOrder);
+        }
+    };
+
+    const HistOrder *PoolOrders(const Entry &e) const {
+        return pool.data() + (e.first_order - pool_base);
+    }
+
+    void ApplyEntry(const Entry &e, HistoricalBook &out) const {
+        out.Set(e.is_bid, e.price, PoolOrders(e), e.num_orders);
+    }
+
+    // the orders and the level_index slots are counted by capacity
+    static constexpr size_t kEntryBytes = sizeof(Entry);
+    // a level_index key, its map node with the tree links
+    static constexpr size_t kIndexKeyBytes =
+        sizeof(std::pair<const LevelKey, LevelEntries>) + 4 * sizeof(void *);
+
+    void LogLevel(const Book &book, const LevelRef &ref) {
+        Entry e{version, ref.is_bid, ref.price, pool_base + pool.size(), 0};
+        if (auto level = book.FindLevelView(ref.is_bid, ref.price)) {
+            level->ForEachOrder([&](const Order &o) {
+                pool.push_back(HistOrder{o.orderId, o.size});
+                e.num_orders++;
+            });
+        }
+        auto [it, added] =
+            level_index.try_emplace(LevelKey{ref.is_bid, ref.price});
+        if (added)
+            bytes += kIndexKeyBytes;
+        auto &entries = it->second.entries;
+        index_slots -= entries.capacity();
+        entries.push_back(log_base + log.size());
+        index_slots += entries.capacity();
+        log.push_back(e);
+        bytes += kEntryBytes;
+    }
+
+    void TakeCheckpoint(const Book &book) {
+        Checkpoint cp{version, log_base + log.size(), {}, {}};
+        for (bool is_bid : {true, false}) {
+            book.ForEachLevelView(is_bid, [&](const auto &level) {
+                if (!level.EstimatedQty())
+                    return true;
+                CheckpointLevel l{is_bid, level.price,
+                                  static_cast<uint32_t>(cp.orders.size()), 0};
+                level.ForEachOrder([&](const Order &o) {
+                    cp.orders.push_back(HistOrder{o.orderId, o.size});
+                    l.num_orders++;
+                });
+                cp.levels.push_back(l);
+                return true;
+            });
+        }
+        cp.levels.shrink_to_fit();
+        cp.orders.shrink_to_fit();
+        bytes += cp.Bytes();
+        checkpoints.push_back(std::move(cp));
+        updates_since_checkpoint = 0;
+    }
+
+    // drop the oldest checkpoint and its log until within budget, the
+    // newest checkpoint and its log are always kept
+    void Trim() {
+        while (memory_budget && checkpoints.size() > 1 &&
+               MemoryUsage() > memory_budget) {
+            bytes -= checkpoints.front().Bytes();
+            checkpoints.pop_front();
+            auto new_base = checkpoints.front().log_end;
+            while (log_base < new_base) {
+                bytes -= kEntryBytes;
+                log.pop_front();
+                log_base++;
+            }
+            // the first remaining entry owns the oldest orders still needed
+            pool_live = log.empty() ? pool_base + pool.size()
+                                    : log.front().first_order;
+            for (auto it = level_index.begin(); it != level_index.end();) {
+                auto &[entries, head] = it->second;
+                while (head < entries.size() && entries[head] < log_base)
+                    head++;
+                if (head == entries.size()) {
+                    bytes -= kIndexKeyBytes;
+                    index_slots -= entries.capacity();
+                    it = level_index.erase(it);
+                    continue;
+                }
+                if (head * 2 > entries.size()) {
+                    index_slots -= entries.capacity();
+                    entries.erase(entries.begin(), entries.begin() + head);
+                    entries.shrink_to_fit();
+                    index_slots += entries.capacity();
+                    head = 0;
+                }
+                ++it;
+            }
+            // the dead orders are moved out once they make up half the pool,
+            // so each order is moved O(1) times, or sooner if they are what
+            // keeps the history over budget
+            auto dead = pool_live - pool_base;
+            if (dead && (dead * 2 > pool.size() ||
+                         MemoryUsage() > memory_budget))
+                CompactPool();
+        }
+    }
+
+    // frees the dead prefix of the pool and its spare capacity
+    void CompactPool() {
+        std::vector<HistOrder> live(pool.begin() + (pool_live - pool_base),
+                                    pool.end());
+        pool.swap(live);
+        pool_base = pool_live;
+    }
+
+    int version = 0;
+    uint64_t updates_since_checkpoint = 0;
+
+    std::deque<Checkpoint> checkpoints;
+    // log[i - log_base] is the entry with global index i
+    std::deque<Entry> log;
+    uint64_t log_base = 0;
+    // orders of the log entries, pool[i - pool_base] has global index i.
+    // the ones before pool_live belong to trimmed entries
+    std::vector<HistOrder> pool;
+    uint64_t pool_base = 0;
+    uint64_t pool_live = 0;
+    size_t bytes = 0;
+    // total capacity of the LevelEntries::entries vectors
+    size_t index_slots = 0;
+    std::map<LevelKey, LevelEntries> level_index;
+};
+
+using BookHistory = BookHistoryT<SmartL3Book>;
@@ -1,6 +1,11 @@
+#pragma once
 
+// the book is templated on its feature policy (smart_ob.h), SmartL3Book has
+// every feature enabled
+template <typename Policy> struct SmartL3BookT;
+struct FullBookPolicy;
+using SmartL3Book = SmartL3BookT<FullBookPolicy>;
 
-struct SmartL3Book;
 struct OrderInfo {
     int order_id;
     bool is_buy;
@@ -8,15 +13,27 @@ struct OrderInfo {
     double price;
 };
 
-struct SmartObCallback {
-    virtual ~SmartObCallback() = default;
+template <typename Book> struct SmartObCallbackT {
+    virtual ~SmartObCallbackT() = default;
 
-    virtual void onOrderAdd(const SmartL3Book &smartOrderBook,
+    virtual void onOrderAdd(const Book &smartOrderBook,
                             const OrderInfo &orderInfo) {};
-    virtual void onOrderCancel(const SmartL3Book &smartOrderBook,
+    virtual void onOrderCancel(const Book &smartOrderBook,
                                const OrderInfo &orderInfo) {};
-    virtual void onOrderModify(const SmartL3Book &smartOrderBook,
+    virtual void onOrderModify(const Book &smartOrderBook,
                                const OrderInfo &orderInfo) {};
-    virtual void onOrderExecution(const SmartL3Book &smartOrderBook,
+    virtual void onOrderExecution(const Book &smartOrderBook,
                                   const OrderInfo &orderInfo) {};
-};
\ No newline at end of file
+};
+
+using SmartObCallback = SmartObCallbackT<SmartL3Book>;
+
+// notified once an update is fully applied and its callbacks have run,
+// SmartL3Book::TouchedLevels() then lists the levels the update changed
+template <typename Book> struct SmartObObserverT {
+    virtual ~SmartObObserverT() = default;
+
+    virtual void onUpdate(const Book &smartOrderBook) {};
+};
+
+using SmartObObserver = SmartObObserverT<SmartL3Book>;
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <callback.h>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include <ob.h>
+#include <smart_ob.h>
+#include <vector>
+
+// Consolidated view of the same instrument on several venues, each venue
+// being its own SmartL3BookT, all of the same policy.
+//
+// The merged sides are ordered maps keyed by price, holding the total
+// estimated qty and the per venue breakdown, so they are the k-way merge of
+// the venue books kept up to date in place. After each venue update only the
+// levels the update touched (including the ones it removed) are re-read from
+// that venue, so the cost per event does not depend on the book depth.
+
+struct ConsolidatedBbo {
+    bool has_bid = false, has_ask = false;
+    double bid_price = 0, ask_price = 0;
+    int bid_qty = 0, ask_qty = 0;
+
+    bool operator==(const ConsolidatedBbo &) const = default;
+};
+
+struct ConsolidatedLevel {
+    int qty = 0;
+    // estimated qty of each venue at this price
+    std::vector<int> venue_qty;
+};
+
+template <typename Book> struct ConsolidatedBookT;
+
+template <typename Book> struct ConsolidatedCallbackT {
+    virtual ~ConsolidatedCallbackT() = default;
+
+    // best price or qty of either side changed
+    virtual void onBboChange(const ConsolidatedBookT<Book> &book,
+                             const ConsolidatedBbo &bbo) {};
+};
+
+template <typename Book> struct ConsolidatedBookT {
+    using Callback = ConsolidatedCallbackT<Book>;
+
+    explicit ConsolidatedBookT(size_t num_venues, Callback *callback = nullptr)
+        : callback(callback), venues(num_venues) {
+        for (size_t v = 0; v < num_venues; v++) {
+            venues[v].parent = this;
+            venues[v].venue = v;
+        }
+    }
+
+    // the venue observers are registered by address
+    ConsolidatedBookT(const ConsolidatedBookT &) = delete;
+    ConsolidatedBookT &operator=(const ConsolidatedBookT &) = delete;
+
+    // the venue book must outlive this, or at least stop being updated. its
+    // current levels are merged right away. false if there is no such venue
+    bool Attach(size_t venue, Book &book) {
+        if (venue >= venues.size())
+            return false;
+        auto &v = venues[venue];
+        book.ForEachLevelView(true, [&](const auto &level) {
+            SetVenueQty(v, v.bids, bids, level.price, level.EstimatedQty());
+            return true;
+        });
+        book.ForEachLevelView(false, [&](const auto &level) {
+            SetVenueQty(v, v.asks, asks, level.price, level.EstimatedQty());
+            return true;
+        });
+        UpdateBbo();
+        book.AddObserver(&v);
+        return true;
+    }
+
+    const ConsolidatedBbo &Bbo() const { return bbo; }
+
+    size_t NumVenues() const { return venues.size(); }
+
+    // calls f(price, const ConsolidatedLevel &) for at most depth levels from
+    // the touch outwards
+    template <typename Func>
+    void ForEachLevel(bool is_bid, size_t depth, Func &&f) const {
+        auto visit = [&](const auto &side) {
+            for (const auto &[price, level] : side) {
+                if (!depth--)
+                    return;
+                f(price, level);
+            }
+        };
+        if (is_bid)
+            visit(bids);
+        else
+            visit(asks);
+    }
+
+    const ConsolidatedLevel *FindLevel(bool is_bid, double price) const {
+        if (is_bid) {
+            auto it = bids.find(price);
+            return it == bids.end() ? nullptr : &it->second;
+        }
+        auto it = asks.find(price);
+        return it == asks.end() ? nullptr : &it->second;
+    }
+
+    size_t NumLevels(bool is_bid) const {
+        return is_bid ? bids.size() : asks.size();
+    }
+
+  private:
+    struct VenueObserver : SmartObObserverT<Book> {
+        void onUpdate(const Book &book) override {
+            parent->OnVenueUpdate(venue, book);
+        }
+
+        ConsolidatedBookT *parent = nullptr;
+        size_t venue = 0;
+        // what this venue currently contributes, per side
+        OneSideBook<int, BidComparator> bids;
+        OneSideBook<int, AskComparator> asks;
+    };
+
+    void OnVenueUpdate(size_t venue, const Book &book) {
+        auto &v = venues[venue];
+        for (const auto &ref : book.TouchedLevels()) {
+            auto level = book.FindLevelView(ref.is_bid, ref.price);
+            int qty = level ? level->EstimatedQty() : 0;
+            if (ref.is_bid)
+                SetVenueQty(v, v.bids, bids, ref.price, qty);
+            else
+                SetVenueQty(v, v.asks, asks, ref.price, qty);
+        }
+        UpdateBbo();
+    }
+
+    template <typename VenueSide, typename Side>
+    void SetVenueQty(VenueObserver &v, VenueSide &venue_side, Side &side,
+                     double price, int qty) {
+        auto vit = venue_side.find(price);
+        int old_qty = vit == venue_side.end() ? 0 : vit->second;
+        if (qty == old_qty)
+            return;
+        if (qty)
+            venue_side[price] = qty;
+        else
+            venue_side.erase(vit);
+
+        auto it = side.find(price);
+        if (it == side.end()) {
+            it = side.emplace(price, ConsolidatedLevel{}).first;
+            it->second.venue_qty.resize(venues.size());
+        }
+        auto &level = it->second;
+        level.qty += qty - old_qty;
+        level.venue_qty[v.venue] = qty;
+        if (!level.qty)
+            side.erase(it);
+    }
+
+    void UpdateBbo() {
+        ConsolidatedBbo next;
+        if (!bids.empty()) {
+            next.has_bid = true;
+            next.bid_price = bids.begin()->first;
+            next.bid_qty = bids.begin()->second.qty;
+        }
+        if (!asks.empty()) {
+            next.has_ask = true;
+            next.ask_price = asks.begin()->first;
+            next.ask_qty = asks.begin()->second.qty;
+        }
+        if (next == bbo)
+            return;
+        bbo = next;
+        if (callback)
+            callback->onBboChange(*this, bbo);
+    }
+
+    Callback *callback;
+    std::vector<VenueObserver> venues;
+    OneSideBook<ConsolidatedLevel, BidComparator> bids;
+    OneSideBook<ConsolidatedLevel, AskComparator> asks;
+    ConsolidatedBbo bbo;
+};
+
+using ConsolidatedBook = ConsolidatedBookT<SmartL3Book>;
+using ConsolidatedCallback = ConsolidatedCallbackT<SmartL3Book>;
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <level_soa.h>
+#include <smart_ob.h>
+#include <vector>
+
+// Compact binary encoding of the top N estimated levels for downstream
+// consumers, delta encoded against the previous publish.
+//
+// message  flags:u8 (bit 0 keyframe) counter:varint seq_id:zigzag varint,
+//          then bids, asks. counter numbers the messages of one encoder, so
+//          a consumer notices a lost or repeated delta
+// side     n:varint, then per level mask:u8 and, for each bit set in mask
+//          (1 ticks, 2 qty, 4 num_orders), zigzag varint of the field minus
+//          the same field of the level at the same index in the previous
+//          publish (0 when there was none or for keyframes). bit 8 means the
+//          estimated orders changed and follow, num_orders times order_id
+//          as zigzag varint minus the previous order_id of the level (0 for
+//          the first) and size:varint. without it the level keeps the orders
+//          of the previous publish
+//
+// Unchanged levels cost one byte. The encoder and decoder keep the previous
+// publish in reused buffers, so steady state encoding does not allocate.
+// A delta only applies on top of the message right before it: the decoder
+// drops every delta after a gap in the counter until the next keyframe.
+
+struct DepthLevel {
+    int64_t ticks;
+    int32_t qty;
+    int32_t num_orders;
+};
+
+struct DepthOrder {
+    int32_t order_id;
+    int32_t size;
+
+    bool operator==(const DepthOrder &) const = default;
+};
+
+struct DepthSnapshot {
+    int seq_id = 0;
+    // 0 = bids, 1 = asks, from the touch outwards
+    std::array<std::vector<DepthLevel>, 2> sides;
+    // the estimated orders of each side, level after level, num_orders each
+    std::array<std::vector<DepthOrder>, 2> orders;
+};
+
+// top `depth` levels with estimated orders of each side of the book
+template <typename Book>
+void CaptureDepth(const Book &book, size_t depth, DepthSnapshot &out) {
+    out.seq_id = book.CurrentSeqId();
+    for (int s = 0; s < 2; s++) {
+        auto &side = out.sides[s];
+        auto &orders = out.orders[s];
+        side.clear();
+        orders.clear();
+        book.ForEachLevelView(s == 0, [&](const auto &level) {
+            if (side.size() >= depth)
+                return false;
+            if (int qty = level.EstimatedQty()) {
+                auto first = orders.size();
+                level.ForEachOrder([&](const Order &o) {
+                    orders.push_back(DepthOrder{o.orderId, o.size});
+                });
+                side.push_back(
+                    DepthLevel{ToTicks(level.price), qty,
+                               static_cast<int32_t>(orders.size() - first)});
+            }
+            return true;
+        });
+    }
+}
+
+inline void PutVarint(std::vector<uint8_t> &out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+inline void PutZigzag(std::vector<uint8_t> &out, int64_t v) {
+    PutVarint(out, (static_cast<uint64_t>(v) << 1) ^ (v >> 63));
+}
+
+// false on truncated input
+inline bool GetVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline bool GetZigzag(const uint8_t *&p, const uint8_t *end, int64_t &v) {
+    uint64_t u;
+    if (!GetVarint(p, end, u))
+        return false;
+    v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+    return true;
+}
+
+struct DepthEncoder {
+    // keyframe_every = 0 only sends a keyframe first and after Reset
+    explicit DepthEncoder(size_t depth, uint32_t keyframe_every = 0)
+        : depth(depth), keyframe_every(keyframe_every) {}
+
+    // encodes the book's current depth into out, which is cleared first
+    template <typename Book>
+    void Encode(const Book &book, std::vector<uint8_t> &out) {
+        CaptureDepth(book, depth, cur);
+        Encode(cur, out);
+    }
+
+    void Encode(const DepthSnapshot &depth_snapshot,
+                std::vector<uint8_t> &out) {
+        bool keyframe = need_keyframe ||
+                        (keyframe_every && since_keyframe >= keyframe_every);
+        out.clear();
+        out.push_back(keyframe ? 1 : 0);
+        PutVarint(out, counter++);
+        PutZigzag(out, depth_snapshot.seq_id);
+        for (int s = 0; s < 2; s++) {
+            const auto &levels = depth_snapshot.sides[s];
+            const auto *orders = depth_snapshot.orders[s].data();
+            const auto &base = prev.sides[s];
+            const auto *base_orders = prev.orders[s].data();
+            PutVarint(out, levels.size());
+            for (size_t i = 0; i < levels.size(); i++) {
+                DepthLevel b{0, 0, 0};
+                if (!keyframe && i < base.size())
+                    b = base[i];
+                const auto &l = levels[i];
+                bool orders_changed =
+                    l.num_orders != b.num_orders ||
+                    !std::equal(orders, orders + l.num_orders, base_orders);
+                uint8_t mask = (l.ticks != b.ticks) |
+                               (l.qty != b.qty) << 1 |
+                               (l.num_orders != b.num_orders) << 2 |
+                               orders_changed << 3;
+                out.push_back(mask);
+                if (mask & 1)
+                    PutZigzag(out, l.ticks - b.ticks);
+                if (mask & 2)
+                    PutZigzag(out, l.qty - b.qty);
+                if (mask & 4)
+                    PutZigzag(out, l.num_orders - b.num_orders);
+                if (mask & 8) {
+                    int64_t prev_id = 0;
+                    for (int32_t o = 0; o < l.num_orders; o++) {
+                        PutZigzag(out, orders[o].order_id - prev_id);
+                        PutVarint(out, static_cast<uint32_t>(orders[o].size));
+                        prev_id = orders[o].order_id;
+                    }
+                }
+                orders += l.num_orders;
+                if (i < base.size())
+                    base_orders += base[i].num_orders;
+            }
+        }
+
+        if (&depth_snapshot != &prev) {
+            prev.seq_id = depth_snapshot.seq_id;
+            for (int s = 0; s < 2; s++) {
+                prev.sides[s].assign(depth_snapshot.sides[s].begin(),
+                                     depth_snapshot.sides[s].end());
+                prev.orders[s].assign(depth_snapshot.orders[s].begin(),
+                                      depth_snapshot.orders[s].end());
+            }
+        }
+        need_keyframe = false;
+        since_keyframe = keyframe ? 1 : since_keyframe + 1;
+    }
+
+    // the next message is a keyframe, e.g. when a consumer joins
+    void Reset() { need_keyframe = true; }
+
+  private:
+    size_t depth;
+    uint32_t keyframe_every;
+    uint32_t since_keyframe = 0;
+    bool need_keyframe = true;
+    // of the next message, keeps counting across Reset
+    uint64_t counter = 0;
+    DepthSnapshot prev, cur;
+};
+
+struct DepthDecoder {
+    // applies one message, false if it is malformed or a delta arrived
+    // before any keyframe or after a lost message
+    bool Decode(const uint8_t *data, size_t size) {
+        const uint8_t *p = data, *end = data + size;
+        if (p == end)
+            return false;
+        bool keyframe = *p++ & 1;
+        if (!keyframe && !synced)
+            return false;
+
+        uint64_t msg_counter;
+        if (!GetVarint(p, end, msg_counter))
+            return false;
+        if (!keyframe && msg_counter != counter + 1) {
+            gaps++;
+            return Desync();
+        }
+
+        int64_t seq_id;
+        if (!GetZigzag(p, end, seq_id))
+            return false;
+        for (int s = 0; s < 2; s++) {
+            uint64_t n;
+            if (!GetVarint(p, end, n))
+                return Desync();
+            auto &base = state.sides[s];
+            auto &base_orders = state.orders[s];
+            size_t base_first = 0;
+            next.clear();
+            next_orders.clear();
+            for (size_t i = 0; i < n; i++) {
+                if (p == end)
+                    return Desync();
+                uint8_t mask = *p++;
+                DepthLevel l{0, 0, 0};
+                bool has_base = !keyframe && i < base.size();
+                if (has_base)
+                    l = base[i];
+                int64_t d;
+                if (mask & 1) {
+                    if (!GetZigzag(p, end, d))
+                        return Desync();
+                    l.ticks += d;
+                }
+                if (mask & 2) {
+                    if (!GetZigzag(p, end, d))
+                        return Desync();
+                    l.qty += d;
+                }
+                if (mask & 4) {
+                    if (!GetZigzag(p, end, d))
+                        return Desync();
+                    l.num_orders += d;
+                }
+                if (l.num_orders < 0)
+                    return Desync();
+                if (mask & 8) {
+                    // each order takes at least two bytes
+                    if (l.num_orders > (end - p) / 2)
+                        return Desync();
+                    int64_t id = 0;
+                    uint64_t size;
+                    for (int32_t o = 0; o < l.num_orders; o++) {
+                        if (!GetZigzag(p, end, d) || !GetVarint(p, end, size))
+                            return Desync();
+                        id += d;
+                        next_orders.push_back(
+                            DepthOrder{static_cast<int32_t>(id),
+                                       static_cast<int32_t>(size)});
+                    }
+                } else {
+                    // the orders of the previous publish, same count
+                    if (l.num_orders &&
+                        (!has_base || base[i].num_orders != l.num_orders))
+                        return Desync();
+                    next_orders.insert(next_orders.end(),
+                                       base_orders.begin() + base_first,
+                                       base_orders.begin() + base_first +
+                                           l.num_orders);
+                }
+                if (i < base.size())
+                    base_first += base[i].num_orders;
+                next.push_back(l);
+            }
+            base.swap(next);
+            base_orders.swap(next_orders);
+        }
+        state.seq_id = seq_id;
+        counter = msg_counter;
+        synced = true;
+        return true;
+    }
+
+    const DepthSnapshot &State() const { return state; }
+    bool Synced() const { return synced; }
+    // deltas that did not follow the previous message
+    uint64_t Gaps() const { return gaps; }
+
+  private:
+    // a half applied message leaves the state unusable until a keyframe
+    bool Desync() {
+        synced = false;
+        return false;
+    }
+
+    bool synced = false;
+    // of the last applied message
+    uint64_t counter = 0;
+    uint64_t gaps = 0;
+    DepthSnapshot state;
+    std::vector<DepthLevel> next;
+    std::vector<DepthOrder> next_orders;
+};
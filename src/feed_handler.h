@@ -0,0 +1,450 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <netinet/in.h>
+#include <reader.h>
+#include <smart_ob.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// UDP feed handler for the three streams, and a loopback publisher that
+// replays a capture file so the handler can be tested offline.
+//
+// Every datagram carries one message, little endian and packed:
+//
+// header  stream:u8 type:u8 is_buy:u8 pad:u8 packet_seq:u32 send_ns:u64
+//         seq_id:i32
+// L3      order_id:i32 size:i32 price:f64
+// L2      num_bids:u16 num_asks:u16 then (price:f64 qty:i32) per level
+// TRADE   size:i32 price:f64
+//
+// packet_seq is contiguous per stream and is used for drop detection,
+// send_ns is the publisher's steady clock.
+
+enum FeedStream : uint8_t { L3Stream, L2Stream, TradeStream, kNumStreams };
+
+enum L3Type : uint8_t { L3AddType, L3ModifyType, L3CancelType, L3ExecType };
+
+constexpr size_t kFeedHeaderSize = 20;
+constexpr size_t kMaxDatagram = 9000;
+
+inline uint64_t SteadyNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+template <typename T> inline void Put(char *&p, T v) {
+    std::memcpy(p, &v, sizeof(T));
+    p += sizeof(T);
+}
+
+template <typename T> inline T Get(const char *&p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+}
+
+// StreamMsg alternatives are declared in FeedStream order
+inline FeedStream StreamOf(const StreamMsg &msg) {
+    return static_cast<FeedStream>(msg.index());
+}
+
+// encode one message into buf (at least kMaxDatagram bytes), returns its size
+// or 0 if it does not fit in a datagram
+inline size_t EncodeMessage(const StreamMsg &msg, uint32_t packet_seq,
+                            uint64_t send_ns, char *buf) {
+    char *p = buf;
+    auto header = [&](FeedStream stream, uint8_t type, bool is_buy,
+                      int seq_id) {
+        Put<uint8_t>(p, stream);
+        Put<uint8_t>(p, type);
+        Put<uint8_t>(p, is_buy);
+        Put<uint8_t>(p, 0);
+        Put<uint32_t>(p, packet_seq);
+        Put<uint64_t>(p, send_ns);
+        Put<int32_t>(p, seq_id);
+    };
+
+    if (auto *l3 = std::get_if<Level3>(&msg)) {
+        std::visit(
+            [&](auto &&arg) {
+                using T = std::decay_t<decltype(arg)>;
+                int size = 0;
+                double price = 0;
+                uint8_t type;
+                if constexpr (std::is_same_v<T, level3::Add>) {
+                    type = L3AddType, size = arg.size, price = arg.price;
+                } else if constexpr (std::is_same_v<T, level3::Modify>) {
+                    type = L3ModifyType, size = arg.size, price = arg.price;
+                } else if constexpr (std::is_same_v<T, level3::Cancel>) {
+                    type = L3CancelType;
+                } else {
+                    type = L3ExecType, size = arg.size;
+                }
+                header(L3Stream, type, arg.is_buy, l3->seq_id);
+                Put<int32_t>(p, arg.order_id);
+                Put<int32_t>(p, size);
+                Put<double>(p, price);
+            },
+            l3->msg);
+    } else if (auto *l2 = std::get_if<Snapshot>(&msg)) {
+        auto levels = l2->bids.size() + l2->asks.size();
+        if (kFeedHeaderSize + 4 + levels * 12 > kMaxDatagram)
+            return 0;
+        header(L2Stream, 0, false, l2->seq_id);
+        Put<uint16_t>(p, l2->bids.size());
+        Put<uint16_t>(p, l2->asks.size());
+        for (auto *side : {&l2->bids, &l2->asks}) {
+            for (auto &l : *side) {
+                Put<double>(p, l.price);
+                Put<int32_t>(p, l.qty);
+            }
+        }
+    } else {
+        auto &trade = std::get<Trade>(msg);
+        header(TradeStream, 0, trade.is_buy, trade.seq_id);
+        Put<int32_t>(p, trade.size);
+        Put<double>(p, trade.price);
+    }
+    return p - buf;
+}
+
+struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+
+    void Add(uint64_t ns) {
+        count++;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+    }
+    double AvgNs() const { return count ? double(total_ns) / count : 0; }
+};
+
+struct FeedStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t malformed = 0;
+    // packets missing according to the per stream packet_seq
+    std::array<uint64_t, kNumStreams> drops{};
+
+    uint64_t batches = 0;
+    uint64_t max_batch = 0;
+    double AvgBatch() const { return batches ? double(packets) / batches : 0; }
+
+    // recvmmsg return to book update (and its callbacks) done
+    LatencyStats recv_to_callback;
+    // publisher send to book update done, meaningful on the same host only
+    LatencyStats send_to_callback;
+};
+
+struct FeedConfig {
+    // 0 binds an ephemeral port, see UdpFeedHandler::Port
+    std::array<uint16_t, kNumStreams> ports{};
+    std::string bind_addr = "127.0.0.1";
+    unsigned batch = 64;
+    // SO_BUSY_POLL in microseconds, 0 disables
+    int busy_poll_us = 50;
+    int rcvbuf = 4 << 20;
+};
+
+template <typename Book = SmartL3Book> struct UdpFeedHandler {
+    UdpFeedHandler(Book &book, const FeedConfig &config = {})
+        : book(book), config(config),
+          storage(config.batch * kMaxDatagram) {
+        iovecs.resize(config.batch);
+        msgs.resize(config.batch);
+        for (unsigned i = 0; i < config.batch; i++) {
+            iovecs[i].iov_base = storage.data() + i * kMaxDatagram;
+            iovecs[i].iov_len = kMaxDatagram;
+            std::memset(&msgs[i], 0, sizeof(mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        // decoded snapshots reuse this, so steady state does not allocate
+        snapshot.bids.reserve(64);
+        snapshot.asks.reserve(64);
+
+        fds.fill(-1);
+        for (int s = 0; s < kNumStreams; s++)
+            Open(static_cast<FeedStream>(s));
+    }
+
+    ~UdpFeedHandler() {
+        for (auto fd : fds)
+            if (fd >= 0)
+                close(fd);
+    }
+
+    UdpFeedHandler(const UdpFeedHandler &) = delete;
+    UdpFeedHandler &operator=(const UdpFeedHandler &) = delete;
+
+    // false with Error() set if a socket could not be bound
+    bool Good() const { return error.empty(); }
+    const std::string &Error() const { return error; }
+    // whether the kernel accepted SO_BUSY_POLL, it needs CAP_NET_ADMIN to
+    // go above net.core.busy_read
+    bool BusyPolling() const { return busy_poll; }
+
+    uint16_t Port(FeedStream stream) const { return ports[stream]; }
+    const std::array<uint16_t, kNumStreams> &Ports() const { return ports; }
+
+    // drain what is available on every stream without blocking, returns the
+    // number of packets processed
+    size_t Poll() {
+        size_t total = 0;
+        for (int s = 0; s < kNumStreams; s++) {
+            if (fds[s] < 0)
+                continue;
+            int n;
+            while ((n = recvmmsg(fds[s], msgs.data(), config.batch,
+                                 MSG_DONTWAIT, nullptr)) > 0) {
+                auto recv_ns = SteadyNowNs();
+                stats.batches++;
+                stats.max_batch = std::max<uint64_t>(stats.max_batch, n);
+                for (int i = 0; i < n; i++)
+                    Handle(static_cast<FeedStream>(s),
+                           storage.data() + i * kMaxDatagram,
+                           msgs[i].msg_len, recv_ns);
+                total += n;
+                processed.store(stats.packets, std::memory_order_release);
+                if (static_cast<unsigned>(n) < config.batch)
+                    break;
+            }
+        }
+        return total;
+    }
+
+    // busy poll until stop is set
+    void Run(const std::atomic<bool> &stop) {
+        while (!stop.load(std::memory_order_acquire))
+            Poll();
+        Poll();
+    }
+
+    // packets handled so far, safe to read from another thread while Run is
+    // going, unlike stats
+    uint64_t Processed() const {
+        return processed.load(std::memory_order_acquire);
+    }
+
+    FeedStats stats;
+
+  private:
+    void Open(FeedStream stream) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            error = std::string("socket: ") + std::strerror(errno);
+            return;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf,
+                   sizeof(config.rcvbuf));
+#ifdef SO_BUSY_POLL
+        if (config.busy_poll_us > 0)
+            busy_poll = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                                   &config.busy_poll_us,
+                                   sizeof(config.busy_poll_us)) == 0;
+#endif
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.ports[stream]);
+        inet_pton(AF_INET, config.bind_addr.c_str(), &addr.sin_addr);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+            error = std::string("bind: ") + std::strerror(errno);
+            close(fd);
+            return;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+        ports[stream] = ntohs(addr.sin_port);
+        fds[stream] = fd;
+    }
+
+    // decode straight out of the receive buffer into the book update
+    void Handle(FeedStream stream, const char *p, size_t len,
+                uint64_t recv_ns) {
+        stats.packets++;
+        stats.bytes += len;
+        if (len < kFeedHeaderSize || p[0] != stream) {
+            stats.malformed++;
+            return;
+        }
+        const char *end = p + len;
+        Get<uint8_t>(p); // stream, checked above
+        auto type = Get<uint8_t>(p);
+        bool is_buy = Get<uint8_t>(p);
+        Get<uint8_t>(p);
+        auto packet_seq = Get<uint32_t>(p);
+        auto send_ns = Get<uint64_t>(p);
+        auto seq_id = Get<int32_t>(p);
+
+        auto &expected = next_packet_seq[stream];
+        if (packet_seq > expected)
+            stats.drops[stream] += packet_seq - expected;
+        expected = std::max(expected, packet_seq + 1);
+
+        switch (stream) {
+        case L3Stream: {
+            if (end - p < 16) {
+                stats.malformed++;
+                return;
+            }
+            auto order_id = Get<int32_t>(p);
+            auto size = Get<int32_t>(p);
+            auto price = Get<double>(p);
+            Level3 msg{seq_id, {}};
+            switch (type) {
+            case L3AddType:
+                msg.msg = level3::Add{order_id, is_buy, size, price};
+                break;
+            case L3ModifyType:
+                msg.msg = level3::Modify{order_id, is_buy, size, price};
+                break;
+            case L3CancelType:
+                msg.msg = level3::Cancel{order_id, is_buy};
+                break;
+            case L3ExecType:
+                msg.msg = level3::Execute{order_id, is_buy, size};
+                break;
+            default:
+                // never guess, a wrong cancel would silently drop an order
+                stats.malformed++;
+                return;
+            }
+            book.UpdateL3(msg);
+            break;
+        }
+        case L2Stream: {
+            if (end - p < 4) {
+                stats.malformed++;
+                return;
+            }
+            auto num_bids = Get<uint16_t>(p);
+            auto num_asks = Get<uint16_t>(p);
+            if (end - p < (num_bids + num_asks) * 12) {
+                stats.malformed++;
+                return;
+            }
+            snapshot.seq_id = seq_id;
+            snapshot.bids.clear();
+            snapshot.asks.clear();
+            for (int i = 0; i < num_bids + num_asks; i++) {
+                auto price = Get<double>(p);
+                auto qty = Get<int32_t>(p);
+                (i < num_bids ? snapshot.bids : snapshot.asks)
+                    .push_back(L2PriceLevel{price, qty});
+            }
+            // dropped by a book built without the stream, like Dispatch
+            if constexpr (requires { book.UpdateL2(snapshot); })
+                book.UpdateL2(snapshot);
+            break;
+        }
+        default: {
+            if (end - p < 12) {
+                stats.malformed++;
+                return;
+            }
+            auto size = Get<int32_t>(p);
+            auto price = Get<double>(p);
+            Trade trade{seq_id, is_buy, price, size};
+            if constexpr (requires { book.UpdateTrade(trade); })
+                book.UpdateTrade(trade);
+            break;
+        }
+        }
+
+        auto done_ns = SteadyNowNs();
+        stats.recv_to_callback.Add(done_ns - recv_ns);
+        if (send_ns && done_ns >= send_ns)
+            stats.send_to_callback.Add(done_ns - send_ns);
+    }
+
+    Book &book;
+    FeedConfig config;
+
+    std::array<int, kNumStreams> fds;
+    std::array<uint16_t, kNumStreams> ports{};
+    std::array<uint32_t, kNumStreams> next_packet_seq{};
+    bool busy_poll = false;
+    std::string error;
+    std::atomic<uint64_t> processed{0};
+
+    // preallocated receive buffers, one datagram slot per batch entry
+    std::vector<char> storage;
+    std::vector<iovec> iovecs;
+    std::vector<mmsghdr> msgs;
+    Snapshot snapshot;
+};
+
+// replays messages to a feed handler over loopback
+struct LoopbackPublisher {
+    explicit LoopbackPublisher(const std::array<uint16_t, kNumStreams> &ports,
+                               const std::string &addr = "127.0.0.1")
+        : fd(socket(AF_INET, SOCK_DGRAM, 0)) {
+        for (int s = 0; s < kNumStreams; s++) {
+            dest[s].sin_family = AF_INET;
+            dest[s].sin_port = htons(ports[s]);
+            inet_pton(AF_INET, addr.c_str(), &dest[s].sin_addr);
+        }
+    }
+
+    ~LoopbackPublisher() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    LoopbackPublisher(const LoopbackPublisher &) = delete;
+    LoopbackPublisher &operator=(const LoopbackPublisher &) = delete;
+
+    bool Send(const StreamMsg &msg) {
+        auto stream = StreamOf(msg);
+        auto len = EncodeMessage(msg, packet_seq[stream], SteadyNowNs(), buf);
+        return len && SendRaw(stream, buf, len);
+    }
+
+    // sends an already encoded datagram, e.g. a corrupted one
+    bool SendRaw(FeedStream stream, const char *data, size_t len) {
+        auto sent = sendto(fd, data, len, 0,
+                           reinterpret_cast<const sockaddr *>(&dest[stream]),
+                           sizeof(dest[stream]));
+        if (sent != static_cast<ssize_t>(len))
+            return false;
+        packet_seq[stream]++;
+        return true;
+    }
+
+    uint32_t NextPacketSeq(FeedStream stream) const {
+        return packet_seq[stream];
+    }
+
+    // skip a packet_seq, as if the network had dropped the datagram
+    void SkipPacket(FeedStream stream) { packet_seq[stream]++; }
+
+    // sends every message of a capture stream, returns the number sent
+    size_t Replay(std::istream &capture) {
+        size_t sent = 0;
+        StreamMsg msg;
+        while (ReadMessage(capture, msg))
+            sent += Send(msg);
+        return sent;
+    }
+
+  private:
+    int fd;
+    std::array<sockaddr_in, kNumStreams> dest{};
+    std::array<uint32_t, kNumStreams> packet_seq{};
+    char buf[kMaxDatagram];
+};
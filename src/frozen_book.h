@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stream_msg.h>
+#include <vector>
+
+// Compact read-only form of a hibernated SmartL3Book, see
+// SmartL3BookT::Hibernate. Exactly sized arrays replace the level map nodes,
+// the order list nodes, orderMap (a sorted array of the order ids) and the
+// per level trade deques. It keeps the full state, not only the estimated
+// orders, so thawing restores the book exactly.
+
+struct FrozenOrder {
+    int orderId;
+    int size;
+};
+
+struct FrozenLevel {
+    double price;
+    int qty;
+    // qty when the book has no L2 reconciliation
+    int l2_qty;
+    int unconfirmed_trade_qty;
+    // ranges in FrozenBook::orders and FrozenBook::trades
+    uint32_t first_order;
+    uint32_t num_orders;
+    uint32_t first_trade;
+    uint32_t num_trades;
+};
+
+struct FrozenBook {
+    // bids then asks, each from the touch outwards
+    std::vector<FrozenLevel> levels;
+    size_t num_bids = 0;
+    std::vector<FrozenOrder> orders;
+    std::vector<Trade> trades;
+    // the ids of orders, sorted
+    std::vector<int> order_ids;
+
+    size_t Bytes() const {
+        return sizeof(FrozenBook) + levels.capacity() * sizeof(FrozenLevel) +
+               orders.capacity() * sizeof(FrozenOrder) +
+               trades.capacity() * sizeof(Trade) +
+               order_ids.capacity() * sizeof(int);
+    }
+
+    bool HasOrder(int order_id) const {
+        return std::binary_search(order_ids.begin(), order_ids.end(),
+                                  order_id);
+    }
+
+    const FrozenOrder *Orders(const FrozenLevel &level) const {
+        return orders.data() + level.first_order;
+    }
+
+    const Trade *Trades(const FrozenLevel &level) const {
+        return trades.data() + level.first_trade;
+    }
+
+    // calls f(const FrozenLevel &) for the levels of a side from the touch
+    // outwards, until f returns false
+    template <typename Func> void ForEachLevel(bool is_bid, Func &&f) const {
+        size_t first = is_bid ? 0 : num_bids;
+        size_t last = is_bid ? num_bids : levels.size();
+        for (size_t i = first; i < last; i++)
+            if (!f(levels[i]))
+                return;
+    }
+
+    const FrozenLevel *FindLevel(bool is_bid, double price) const {
+        auto first = levels.begin() + (is_bid ? 0 : num_bids);
+        auto last = is_bid ? levels.begin() + num_bids : levels.end();
+        // bids are in descending price order
+        auto it = std::lower_bound(first, last, price,
+                                   [is_bid](const FrozenLevel &l, double p) {
+                                       return is_bid ? l.price > p
+                                                     : l.price < p;
+                                   });
+        return it != last && it->price == price ? &*it : nullptr;
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <smart_ob.h>
+
+// Hibernates the books that had no applied update for `idle_ns`, so the many
+// quiet symbols give their memory and cache back to the hot ones. A book
+// thaws itself on its next update. Tick runs on the thread that updates the
+// books, e.g. between feed handler polls.
+
+struct HibernationStats {
+    uint64_t hibernations = 0;
+    uint64_t thaws = 0;
+    // books currently hibernated and the bytes they gave back
+    size_t hibernated = 0;
+    size_t bytes_reclaimed = 0;
+    // over every hibernation so far
+    size_t total_bytes_reclaimed = 0;
+};
+
+template <typename Book = SmartL3Book> struct HibernationManager {
+    explicit HibernationManager(uint64_t idle_ns) : idle_ns(idle_ns) {}
+
+    // the observers are registered by address
+    HibernationManager(const HibernationManager &) = delete;
+    HibernationManager &operator=(const HibernationManager &) = delete;
+
+    // the book must outlive this, or at least stop being updated
+    void Add(Book &book) {
+        auto &e = entries.emplace_back();
+        e.book = &book;
+        book.AddObserver(&e);
+    }
+
+    void Tick() {
+        Tick(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+                 .count());
+    }
+
+    // a book is idle from the first tick that sees no update since the
+    // previous one, so idleness is measured with the tick resolution
+    void Tick(uint64_t now_ns) {
+        for (auto &e : entries) {
+            if (e.hibernated && !e.book->Hibernated()) {
+                e.hibernated = false;
+                stats.thaws++;
+                stats.hibernated--;
+                stats.bytes_reclaimed -= e.reclaimed;
+            }
+            if (e.updates != e.seen || !e.ticked) {
+                e.seen = e.updates;
+                e.last_active_ns = now_ns;
+                e.ticked = true;
+                continue;
+            }
+            if (!e.hibernated && now_ns - e.last_active_ns >= idle_ns) {
+                e.reclaimed = e.book->Hibernate();
+                e.hibernated = true;
+                stats.hibernations++;
+                stats.hibernated++;
+                stats.bytes_reclaimed += e.reclaimed;
+                stats.total_bytes_reclaimed += e.reclaimed;
+            }
+        }
+    }
+
+    const HibernationStats &Stats() const { return stats; }
+
+    uint64_t idle_ns;
+
+  private:
+    struct Entry : Book::Observer {
+        void onUpdate(const Book &) override { updates++; }
+
+        Book *book = nullptr;
+        uint64_t updates = 0;
+        // updates at the last tick
+        uint64_t seen = 0;
+        uint64_t last_active_ns = 0;
+        bool ticked = false;
+        bool hibernated = false;
+        size_t reclaimed = 0;
+    };
+
+    std::deque<Entry> entries;
+    HibernationStats stats;
+};
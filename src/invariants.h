@@ -0,0 +1,224 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <smart_ob.h>
+
+// Production invariant checks for SmartL3BookT, of any policy.
+//
+// After each update only the levels it touched are checked, in O(orders of
+// those levels) and without building the estimated orders. A full sweep of
+// the book and orderMap runs every `full_sweep_every` updates. Violations are
+// counted and reported to `on_violation` instead of asserting, so the checker
+// can stay enabled in release builds.
+//
+// An L2 snapshot touches every level it lists, so checking one costs about
+// as much as a sweep of those levels: O(levels + their orders), with an
+// orderMap lookup per order. With deep, frequent snapshots this dominates
+// the checker, so a latency sensitive deployment may prefer to attach it to
+// a sampled subset of its books.
+
+enum class InvariantKind {
+    // level qty differs from the sum of its order sizes
+    LevelQty,
+    // numOrders differs from the size of the order list
+    LevelOrderCount,
+    // an order of the level has another price or side
+    OrderLevelMismatch,
+    // an order of a level is missing from orderMap or maps to another node
+    OrderMapMissing,
+    // orderMap has entries not belonging to any level
+    OrderMapOrphan,
+    // negative qty, l2_qty or unconfirmed trade qty
+    NegativeQty,
+    // l2_qty differs from qty right after the newest L3 update reconciled it
+    L2Qty,
+    // total_unconfirmed_trade_qty differs from the sum of unconfirmed_trades
+    UnconfirmedQty,
+    // best bid is at or above best ask
+    CrossedBook,
+    kCount
+};
+
+inline const char *InvariantName(InvariantKind k) {
+    static const char *names[] = {
+        "level_qty",         "level_order_count", "order_level_mismatch",
+        "order_map_missing", "order_map_orphan",  "negative_qty",
+        "l2_qty",            "unconfirmed_qty",   "crossed_book"};
+    return names[static_cast<int>(k)];
+}
+
+struct InvariantViolation {
+    InvariantKind kind;
+    int seq_id;
+    // the offending level, for book wide violations the best level involved
+    bool is_bid;
+    double price;
+};
+
+template <typename Book> struct InvariantCheckerT : SmartObObserverT<Book> {
+    using Level = typename Book::Level;
+    using Features = typename Book::Features;
+
+    // 0 disables the full sweeps
+    explicit InvariantCheckerT(uint64_t full_sweep_every = 0)
+        : full_sweep_every(full_sweep_every) {}
+
+    void onUpdate(const Book &book) override {
+        updates++;
+        for (const auto &ref : book.TouchedLevels()) {
+            if (auto *level = book.FindLevel(ref.is_bid, ref.price)) {
+                CheckLevel(book, *level);
+                if constexpr (Features::kL2Reconcile) {
+                    // the newest L3 update sets the confirmed qty of its
+                    // levels
+                    bool reconciled =
+                        book.CurrentSeqId() == book.last_l3_seq_id &&
+                        book.last_l3_seq_id == book.last_l2_seq_id;
+                    if (reconciled && level->l2_qty != level->qty)
+                        Report(book, InvariantKind::L2Qty, *level);
+                }
+            }
+        }
+        CheckCrossed(book);
+        if (full_sweep_every && updates % full_sweep_every == 0)
+            FullSweep(book);
+    }
+
+    // checks every level and the whole orderMap, or the frozen form of a
+    // hibernated book
+    void FullSweep(const Book &book) {
+        sweeps++;
+        if (auto *frozen = book.Frozen()) {
+            frozen_sweeps++;
+            for (const auto &level : frozen->levels)
+                CheckFrozenLevel(book, *frozen, level);
+            CheckCrossed(book);
+            return;
+        }
+        size_t num_orders = 0;
+        for (const auto &[price, level] : book.bids) {
+            CheckLevel(book, level);
+            num_orders += level.orders.size();
+        }
+        for (const auto &[price, level] : book.asks) {
+            CheckLevel(book, level);
+            num_orders += level.orders.size();
+        }
+        // every order of a level was found in orderMap, so equal sizes mean
+        // there is no entry left over
+        if (book.orderMap.size() != num_orders)
+            Report(book, InvariantKind::OrderMapOrphan, true, 0);
+        CheckCrossed(book);
+    }
+
+    uint64_t Count(InvariantKind k) const {
+        return counts[static_cast<int>(k)];
+    }
+    uint64_t Total() const {
+        uint64_t total = 0;
+        for (auto c : counts)
+            total += c;
+        return total;
+    }
+
+    std::function<void(const InvariantViolation &)> on_violation;
+
+    uint64_t full_sweep_every;
+    uint64_t updates = 0;
+    uint64_t sweeps = 0;
+    // sweeps of hibernated books, which have no orderMap to check
+    uint64_t frozen_sweeps = 0;
+
+  private:
+    void CheckLevel(const Book &book, const Level &level) {
+        int qty = 0, num_orders = 0;
+        bool mismatch = false, missing = false;
+        for (const auto &order : level.orders) {
+            qty += order.size;
+            num_orders++;
+            mismatch |=
+                order.price != level.price || order.is_buy != level.is_bid;
+            auto it = book.orderMap.find(order.orderId);
+            missing |= it == book.orderMap.end() || &*it->second != &order;
+        }
+        if (qty != level.qty)
+            Report(book, InvariantKind::LevelQty, level);
+        if (num_orders != level.numOrders)
+            Report(book, InvariantKind::LevelOrderCount, level);
+        if (mismatch)
+            Report(book, InvariantKind::OrderLevelMismatch, level);
+        if (missing)
+            Report(book, InvariantKind::OrderMapMissing, level);
+        if (level.qty < 0 || level.L2Qty() < 0 ||
+            level.UnconfirmedTradeQty() < 0)
+            Report(book, InvariantKind::NegativeQty, level);
+
+        if constexpr (Features::kTradeInference) {
+            int unconfirmed = 0;
+            for (const auto &trade : level.unconfirmed_trades)
+                unconfirmed += trade.size;
+            if (unconfirmed != level.total_unconfirmed_trade_qty)
+                Report(book, InvariantKind::UnconfirmedQty, level);
+        }
+    }
+
+    // the qty and trade checks of CheckLevel, the frozen form has no order
+    // list nodes or orderMap
+    void CheckFrozenLevel(const Book &book, const FrozenBook &frozen,
+                          const FrozenLevel &level) {
+        bool is_bid = &level < frozen.levels.data() + frozen.num_bids;
+        int qty = 0;
+        const auto *orders = frozen.Orders(level);
+        for (uint32_t i = 0; i < level.num_orders; i++)
+            qty += orders[i].size;
+        if (qty != level.qty)
+            Report(book, InvariantKind::LevelQty, is_bid, level.price);
+        if (level.qty < 0 || level.l2_qty < 0 ||
+            level.unconfirmed_trade_qty < 0)
+            Report(book, InvariantKind::NegativeQty, is_bid, level.price);
+
+        int unconfirmed = 0;
+        const auto *trades = frozen.Trades(level);
+        for (uint32_t i = 0; i < level.num_trades; i++)
+            unconfirmed += trades[i].size;
+        if (unconfirmed != level.unconfirmed_trade_qty)
+            Report(book, InvariantKind::UnconfirmedQty, is_bid, level.price);
+    }
+
+    // only levels with estimated orders count, like in ToString
+    static std::optional<double> Best(const Book &book, bool is_bid) {
+        std::optional<double> best;
+        book.ForEachLevelView(is_bid, [&](const auto &level) {
+            if (level.EstimatedQty() > 0)
+                best = level.price;
+            return !best;
+        });
+        return best;
+    }
+
+    void CheckCrossed(const Book &book) {
+        auto bid = Best(book, true);
+        auto ask = Best(book, false);
+        if (bid && ask && *bid >= *ask)
+            Report(book, InvariantKind::CrossedBook, true, *bid);
+    }
+
+    void Report(const Book &book, InvariantKind kind, const Level &level) {
+        Report(book, kind, level.is_bid, level.price);
+    }
+
+    void Report(const Book &book, InvariantKind kind, bool is_bid,
+                double price) {
+        counts[static_cast<int>(kind)]++;
+        if (on_violation)
+            on_violation(
+                InvariantViolation{kind, book.CurrentSeqId(), is_bid, price});
+    }
+
+    std::array<uint64_t, static_cast<int>(InvariantKind::kCount)> counts{};
+};
+
+using InvariantChecker = InvariantCheckerT<SmartL3Book>;
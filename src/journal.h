@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <smart_ob.h>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Decoupled book/callback pipeline.
+//
+// The book thread only serializes compact events into a single-producer ring,
+// consumers poll the ring at their own pace. The ring never blocks the
+// producer: a consumer that falls more than `Capacity` events behind is
+// overrun, detects it and resyncs to the oldest event still in the ring.
+
+enum class EventType : uint8_t { Add, Cancel, Modify, Execution };
+
+struct JournalEvent {
+    int seq_id;
+    EventType type;
+    OrderInfo info;
+};
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// spin forever, lowest latency, burns a core
+struct BusySpinWait {
+    void Reset() {}
+    void Idle() { CpuRelax(); }
+};
+
+// spin, then yield, then sleep with exponential backoff up to max_sleep
+struct BackoffWait {
+    int spin_limit = 128;
+    int yield_limit = 16;
+    std::chrono::microseconds max_sleep{1000};
+
+    void Reset() {
+        spins = 0;
+        sleep = std::chrono::microseconds{1};
+    }
+
+    void Idle() {
+        if (spins < spin_limit) {
+            CpuRelax();
+        } else if (spins < spin_limit + yield_limit) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(sleep);
+            sleep = std::min(sleep * 2, max_sleep);
+        }
+        spins++;
+    }
+
+  private:
+    int spins = 0;
+    std::chrono::microseconds sleep{1};
+};
+
+enum class ReadResult { Ok, Empty, Overrun };
+
+template <typename T, size_t Capacity> struct JournalRing {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of 2");
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    // only one thread may call Publish
+    void Publish(const T &value) {
+        auto n = head.load(std::memory_order_relaxed);
+        auto &slot = slots[n & (Capacity - 1)];
+
+        // seqlock write: mark the slot busy, store the payload, then publish
+        // the sequence number the readers are waiting for
+        slot.seq.store(kBusy, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        Words words{};
+        std::memcpy(words.data(), &value, sizeof(T));
+        for (size_t i = 0; i < kWords; i++)
+            slot.words[i].store(words[i], std::memory_order_relaxed);
+
+        slot.seq.store(n + 1, std::memory_order_release);
+        head.store(n + 1, std::memory_order_release);
+    }
+
+    // read the event at `cursor` (0 based), safe from any thread
+    ReadResult TryRead(uint64_t cursor, T &out) const {
+        auto &slot = slots[cursor & (Capacity - 1)];
+        auto seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != cursor + 1) {
+            if (head.load(std::memory_order_acquire) > cursor + Capacity)
+                return ReadResult::Overrun;
+            return ReadResult::Empty;
+        }
+
+        Words words;
+        for (size_t i = 0; i < kWords; i++)
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // the producer lapped us while we were copying
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            return ReadResult::Overrun;
+
+        std::memcpy(&out, words.data(), sizeof(T));
+        return ReadResult::Ok;
+    }
+
+    // number of events ever published
+    uint64_t Head() const { return head.load(std::memory_order_acquire); }
+
+    using value_type = T;
+    static constexpr size_t capacity = Capacity;
+
+  private:
+    static constexpr uint64_t kBusy = ~uint64_t{0};
+    static constexpr size_t kWords = (sizeof(T) + 7) / 8;
+    using Words = std::array<uint64_t, kWords>;
+
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::array<std::atomic<uint64_t>, kWords> words{};
+    };
+
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::array<Slot, Capacity> slots{};
+};
+
+template <size_t Capacity = 1 << 16>
+using EventJournal = JournalRing<JournalEvent, Capacity>;
+
+// one consumer of a journal, with its own cursor
+template <typename Ring, typename WaitStrategy = BackoffWait>
+struct JournalReader {
+    // start_at_head = true skips the events published before the reader
+    // was created
+    explicit JournalReader(const Ring &ring, bool start_at_head = true,
+                           WaitStrategy wait = {})
+        : ring(ring), wait(wait), cursor(start_at_head ? ring.Head() : 0) {}
+
+    // deliver up to max_events to `f`, returns the number delivered
+    template <typename Func> size_t Poll(Func &&f, size_t max_events = 256) {
+        size_t n = 0;
+        typename Ring::value_type event;
+        while (n < max_events) {
+            auto r = ring.TryRead(cursor, event);
+            if (r == ReadResult::Empty)
+                break;
+            if (r == ReadResult::Overrun) {
+                // jump to the oldest event that is still guaranteed intact
+                auto head = ring.Head();
+                auto resync = head > Ring::capacity ? head - Ring::capacity + 1
+                                                    : 0;
+                if (resync <= cursor)
+                    resync = cursor + 1;
+                overrun_events += resync - cursor;
+                overruns++;
+                cursor = resync;
+                continue;
+            }
+            f(event);
+            cursor++;
+            n++;
+        }
+        return n;
+    }
+
+    // poll until `stop` becomes true, idling with the wait strategy, then
+    // drain whatever is left
+    template <typename Func> void Run(const std::atomic<bool> &stop, Func &&f) {
+        while (!stop.load(std::memory_order_acquire)) {
+            if (Poll(f))
+                wait.Reset();
+            else
+                wait.Idle();
+        }
+        while (Poll(f))
+            ;
+    }
+
+    uint64_t Cursor() const { return cursor; }
+    uint64_t Lag() const { return ring.Head() - cursor; }
+
+    // number of times this reader was lapped, and events lost because of it
+    uint64_t overruns = 0;
+    uint64_t overrun_events = 0;
+
+  private:
+    const Ring &ring;
+    WaitStrategy wait;
+    uint64_t cursor;
+};
+
+// callback that only journals the events, runs on the book thread
+template <size_t Capacity = 1 << 16, typename Book = SmartL3Book>
+struct JournalCallback : SmartObCallbackT<Book> {
+    explicit JournalCallback(EventJournal<Capacity> &journal)
+        : journal(journal) {}
+
+    void onOrderAdd(const Book &book, const OrderInfo &info) override {
+        Publish(book, EventType::Add, info);
+    }
+    void onOrderCancel(const Book &book, const OrderInfo &info) override {
+        Publish(book, EventType::Cancel, info);
+    }
+    void onOrderModify(const Book &book, const OrderInfo &info) override {
+        Publish(book, EventType::Modify, info);
+    }
+    void onOrderExecution(const Book &book, const OrderInfo &info) override {
+        Publish(book, EventType::Execution, info);
+    }
+
+  private:
+    void Publish(const Book &book, EventType type, const OrderInfo &info) {
+        journal.Publish(JournalEvent{book.CurrentSeqId(), type, info});
+    }
+
+    EventJournal<Capacity> &journal;
+};
+
+// persists a journal to disk from a background thread for audit
+//
+// record layout (little endian, packed, 22 bytes):
+// seq_id:i32 type:u8 is_buy:u8 order_id:i32 size:i32 price:f64
+template <size_t Capacity = 1 << 16> struct AsyncJournalWriter {
+    static constexpr size_t kRecordSize = 22;
+
+    AsyncJournalWriter(const EventJournal<Capacity> &journal,
+                       const std::string &path, bool start_at_head = true)
+        : reader(journal, start_at_head),
+          out(path, std::ios::binary | std::ios::trunc) {
+        thread = std::thread([this] {
+            reader.Run(stop, [this](const JournalEvent &e) { Write(e); });
+            PublishCounters();
+            out.flush();
+        });
+    }
+
+    ~AsyncJournalWriter() { Stop(); }
+
+    // drains the journal up to its current head and joins the writer
+    void Stop() {
+        stop.store(true, std::memory_order_release);
+        if (thread.joinable())
+            thread.join();
+    }
+
+    bool Good() const { return out.good(); }
+    // safe to read from any thread while the writer runs
+    uint64_t Written() const { return written.load(std::memory_order_relaxed); }
+    uint64_t Overruns() const {
+        return overruns.load(std::memory_order_relaxed);
+    }
+    uint64_t LostEvents() const {
+        return lost_events.load(std::memory_order_relaxed);
+    }
+
+    static std::vector<JournalEvent> Load(const std::string &path) {
+        std::vector<JournalEvent> events;
+        std::ifstream in(path, std::ios::binary);
+        char buf[kRecordSize];
+        while (in.read(buf, kRecordSize)) {
+            JournalEvent e{};
+            std::memcpy(&e.seq_id, buf, 4);
+            e.type = static_cast<EventType>(buf[4]);
+            e.info.is_buy = buf[5];
+            std::memcpy(&e.info.order_id, buf + 6, 4);
+            std::memcpy(&e.info.size, buf + 10, 4);
+            std::memcpy(&e.info.price, buf + 14, 8);
+            events.push_back(e);
+        }
+        return events;
+    }
+
+  private:
+    void Write(const JournalEvent &e) {
+        char buf[kRecordSize];
+        std::memcpy(buf, &e.seq_id, 4);
+        buf[4] = static_cast<char>(e.type);
+        buf[5] = e.info.is_buy;
+        std::memcpy(buf + 6, &e.info.order_id, 4);
+        std::memcpy(buf + 10, &e.info.size, 4);
+        std::memcpy(buf + 14, &e.info.price, 8);
+        out.write(buf, kRecordSize);
+        written.fetch_add(1, std::memory_order_relaxed);
+        PublishCounters();
+    }
+
+    // the reader's counters are only touched by the writer thread
+    void PublishCounters() {
+        overruns.store(reader.overruns, std::memory_order_relaxed);
+        lost_events.store(reader.overrun_events, std::memory_order_relaxed);
+    }
+
+    JournalReader<EventJournal<Capacity>> reader;
+    std::ofstream out;
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> overruns{0};
+    std::atomic<uint64_t> lost_events{0};
+    std::thread thread;
+};
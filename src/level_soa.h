@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SMART_OB_HAS_AVX2_KERNELS 1
+#endif
+
+// Structure-of-arrays view of the levels of one book side within the price
+// range of a snapshot, and the vector kernels working on it.
+//
+// Prices are compared as integer ticks so a 4-wide AVX2 compare replaces the
+// per-node double comparisons. The AVX2 kernels are compiled with a function
+// level target attribute and selected at runtime, so the binary still runs on
+// CPUs without AVX2.
+
+// fixed point resolution of the ticks, 1e-8 of a price unit
+constexpr double kTicksPerUnit = 1e8;
+
+inline int64_t ToTicks(double price) {
+    return std::llround(price * kTicksPerUnit);
+}
+
+struct LevelSoA {
+    std::vector<int64_t> ticks;
+    std::vector<int32_t> l2_qty;
+
+    size_t Size() const { return ticks.size(); }
+
+    // keeps the capacity, so a reused LevelSoA stops allocating after warmup
+    void Clear() {
+        ticks.clear();
+        l2_qty.clear();
+    }
+
+    void Push(double price, int level_l2_qty) {
+        ticks.push_back(ToTicks(price));
+        l2_qty.push_back(level_l2_qty);
+    }
+};
+
+struct SoaKernels {
+    // for each of the n `keys`, the index of the same tick in `ticks` or -1.
+    // both are sorted from the touch, descending for bids and ascending for
+    // asks, so one merge pass finds all of them
+    void (*match_levels)(const int64_t *keys, size_t n, const int64_t *ticks,
+                         size_t m, bool is_bid, int32_t *index);
+    // out[i] = new_qty[i] - old_qty[i]
+    void (*qty_deltas)(const int32_t *new_qty, const int32_t *old_qty,
+                       size_t n, int32_t *out);
+    const char *name;
+};
+
+namespace soa_scalar {
+inline void MatchLevels(const int64_t *keys, size_t n, const int64_t *ticks,
+                        size_t m, bool is_bid, int32_t *index) {
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        // skip the ticks closer to the touch than the key
+        while (j < m && (is_bid ? ticks[j] > keys[i] : ticks[j] < keys[i]))
+            j++;
+        index[i] = j < m && ticks[j] == keys[i] ? static_cast<int32_t>(j) : -1;
+    }
+}
+
+inline void QtyDeltas(const int32_t *new_qty, const int32_t *old_qty,
+                      size_t n, int32_t *out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = new_qty[i] - old_qty[i];
+}
+} // namespace soa_scalar
+
+#ifdef SMART_OB_HAS_AVX2_KERNELS
+namespace soa_avx2 {
+__attribute__((target("avx2"))) inline void
+MatchLevels(const int64_t *keys, size_t n, const int64_t *ticks, size_t m,
+            bool is_bid, int32_t *index) {
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        // skip the ticks closer to the touch than the key 4 at a time, the
+        // compare mask of a sorted block is a prefix
+        auto key = _mm256_set1_epi64x(keys[i]);
+        while (j + 4 <= m) {
+            auto v = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(ticks + j));
+            auto better = is_bid ? _mm256_cmpgt_epi64(v, key)
+                                 : _mm256_cmpgt_epi64(key, v);
+            auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(better));
+            if (mask != 0xf) {
+                j += __builtin_ctz(~mask);
+                break;
+            }
+            j += 4;
+        }
+        while (j < m && (is_bid ? ticks[j] > keys[i] : ticks[j] < keys[i]))
+            j++;
+        index[i] = j < m && ticks[j] == keys[i] ? static_cast<int32_t>(j) : -1;
+    }
+}
+
+__attribute__((target("avx2"))) inline void
+QtyDeltas(const int32_t *new_qty, const int32_t *old_qty, size_t n,
+          int32_t *out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto a =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(new_qty + i));
+        auto b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(old_qty + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                            _mm256_sub_epi32(a, b));
+    }
+    soa_scalar::QtyDeltas(new_qty + i, old_qty + i, n - i, out + i);
+}
+} // namespace soa_avx2
+#endif
+
+inline const SoaKernels &ScalarKernels() {
+    static const SoaKernels k{soa_scalar::MatchLevels, soa_scalar::QtyDeltas,
+                              "scalar"};
+    return k;
+}
+
+inline bool Avx2Supported() {
+#ifdef SMART_OB_HAS_AVX2_KERNELS
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+// only valid when Avx2Supported()
+inline const SoaKernels &Avx2Kernels() {
+#ifdef SMART_OB_HAS_AVX2_KERNELS
+    static const SoaKernels k{soa_avx2::MatchLevels, soa_avx2::QtyDeltas,
+                              "avx2"};
+    return k;
+#else
+    return ScalarKernels();
+#endif
+}
+
+// the best kernels for the running cpu
+inline const SoaKernels &GetSoaKernels() {
+    static const SoaKernels &k =
+        Avx2Supported() ? Avx2Kernels() : ScalarKernels();
+    return k;
+}
+
+// diff of one snapshot side against the same side of the book
+struct SideDiff {
+    // for each book level, the index of its snapshot level or -1 if the
+    // snapshot no longer has it
+    std::vector<int32_t> book_to_snap;
+    // for each snapshot level, the index of its book level or -1 if new
+    std::vector<int32_t> snap_to_book;
+    // for each book level, snapshot l2 qty (0 if missing) - book l2_qty
+    std::vector<int32_t> l2_deltas;
+
+    // scratch, the snapshot qty of each book level
+    std::vector<int32_t> new_qty;
+
+    void Compute(const SoaKernels &k, const LevelSoA &book,
+                 const LevelSoA &snapshot, bool is_bid) {
+        auto n = book.Size(), m = snapshot.Size();
+        book_to_snap.resize(n);
+        snap_to_book.assign(m, -1);
+        l2_deltas.resize(n);
+        new_qty.resize(n);
+
+        k.match_levels(book.ticks.data(), n, snapshot.ticks.data(), m, is_bid,
+                       book_to_snap.data());
+        for (size_t i = 0; i < n; i++) {
+            auto j = book_to_snap[i];
+            new_qty[i] = j < 0 ? 0 : snapshot.l2_qty[j];
+            if (j >= 0)
+                snap_to_book[j] = static_cast<int32_t>(i);
+        }
+        k.qty_deltas(new_qty.data(), book.l2_qty.data(), n, l2_deltas.data());
+    }
+};
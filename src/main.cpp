@@ -1,36 +1,173 @@
-// #include <fstream>
-// #include <iostream>
+#include <charconv>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
 
-// #include "pnl_calculator.h"
-// #include "reader.h"
+#include "batch_runner.h"
+#include "book_fuzz.h"
+#include "feed_handler.h"
+#include "perf_counters.h"
+#include "reader.h"
+#include "smart_ob.h"
 
-// // takes two command line arguments:
-// // The path to an input file of trades executed throughout the day. See below
-// // for the input format. A string, either fifo or lifo, indicating which
-// // accounting scheme to use.
+// publishes the capture over loopback UDP to a feed handler on its own
+// thread, then prints the feed stats
+int ReplayUdp(std::istream &input, SmartL3Book &book) {
+    UdpFeedHandler handler(book);
+    if (!handler.Good()) {
+        std::cerr << "feed handler: " << handler.Error() << std::endl;
+        return 1;
+    }
+
+    std::atomic<bool> stop{false};
+    std::thread feed([&] { handler.Run(stop); });
+    LoopbackPublisher publisher(handler.Ports());
+    auto sent = publisher.Replay(input);
+
+    // give the handler a moment to drain the socket buffers
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (handler.Processed() >= sent)
+            break;
+    }
+    stop = true;
+    feed.join();
+
+    const auto &s = handler.stats;
+    std::cout << book.ToString();
+    std::cout << "sent: " << sent << " received: " << s.packets
+              << " drops l3/l2/trade: " << s.drops[L3Stream] << "/"
+              << s.drops[L2Stream] << "/" << s.drops[TradeStream]
+              << " malformed: " << s.malformed << "\n"
+              << "batches: " << s.batches << " avg batch: " << s.AvgBatch()
+              << " max batch: " << s.max_batch
+              << " busy poll: " << (handler.BusyPolling() ? "on" : "off")
+              << "\n"
+              << "recv->callback avg ns: " << s.recv_to_callback.AvgNs()
+              << " max ns: " << s.recv_to_callback.max_ns << "\n"
+              << "send->callback avg ns: " << s.send_to_callback.AvgNs()
+              << " max ns: " << s.send_to_callback.max_ns << std::endl;
+    return 0;
+}
+
+// replays every capture file of a manifest in parallel and prints the
+// aggregated report
+int ReplayBatch(std::istream &manifest, unsigned threads) {
+    auto paths = ReadManifest(manifest);
+    auto report = RunBatch(paths, threads);
+    report.Print(std::cout);
+    return report.failed ? 1 : 0;
+}
+
+// differential fuzzing of the runtime selected SoA kernels against the
+// scalar ones, prints the throughput of both and the shrunk repro on failure
+int Fuzz(size_t workloads, uint64_t seed) {
+    NamedEngine reference{"scalar", [] {
+        return std::make_unique<SmartBookEngine<>>(
+            [](SmartL3Book &book) { book.SetSoaKernels(ScalarKernels()); });
+    }};
+    NamedEngine candidate{GetSoaKernels().name, [] {
+        return std::make_unique<SmartBookEngine<>>();
+    }};
+    FuzzConfig config;
+    config.seed = seed;
+    auto report = RunFuzz(config, workloads, reference, {candidate});
+    report.Print(std::cout);
+    return report.failed ? 1 : 0;
+}
+
+int Usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0 << " <capture_file> [--profile | --udp]\n"
+              << "       " << argv0 << " --batch <manifest> [--threads N]\n"
+              << "       " << argv0 << " --fuzz <workloads> [--seed N]"
+              << std::endl;
+    return 1;
+}
+
+// the whole of s as a number, false on garbage, a sign or overflow
+template <typename T> bool ParseNumber(const std::string &s, T &out) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && end == s.data() + s.size();
+}
+
+// replays a capture file (see reader.h for the format) through a SmartL3Book
+// and prints the final book. --profile also prints the hardware counter
+// report of each entry point per message kind, --udp replays it through the
+// UDP feed handler over loopback. --batch takes a manifest of capture files
+// instead and replays them on --threads workers (default one per core).
+// --fuzz runs that many random workloads through the book engines instead.
 int main(int argc, char *argv[]) {
+    std::string path;
+    bool profile = false, udp = false, batch = false;
+    unsigned threads = 0;
+    size_t fuzz = 0;
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool ok = true;
+        if (arg == "--profile")
+            profile = true;
+        else if (arg == "--udp")
+            udp = true;
+        else if (arg == "--batch")
+            batch = true;
+        else if (arg == "--threads")
+            ok = ++i < argc && ParseNumber(argv[i], threads);
+        else if (arg == "--fuzz")
+            ok = ++i < argc && ParseNumber(argv[i], fuzz) && fuzz > 0;
+        else if (arg == "--seed")
+            ok = ++i < argc && ParseNumber(argv[i], seed);
+        else if (arg.rfind("--", 0) == 0 || !path.empty())
+            ok = false;
+        else
+            path = arg;
+        if (!ok) {
+            std::cerr << "invalid argument: " << arg;
+            // the value of an option, if it had one
+            if (i < argc && argv[i] != arg)
+                std::cerr << " " << argv[i];
+            std::cerr << std::endl;
+            return Usage(argv[0]);
+        }
+    }
+    if (fuzz)
+        return Fuzz(fuzz, seed);
+    if (path.empty())
+        return Usage(argv[0]);
+
+    std::ifstream input(path);
+    if (!input.is_open()) {
+        std::cerr << "Error opening file: " << path << std::endl;
+        return 1;
+    }
+
+    if (batch)
+        return ReplayBatch(input, threads);
+
+    StatsCallback cb;
+    SmartL3Book book(&cb);
+    if (udp)
+        return ReplayUdp(input, book);
+
+    BookProfiler profiler;
+
+    StreamMsg msg;
+    uint64_t messages = 0;
+    while (ReadMessage(input, msg)) {
+        if (profile)
+            profiler.Dispatch(book, msg);
+        else
+            Dispatch(book, msg);
+        messages++;
+    }
+
+    std::cout << book.ToString();
+    std::cout << "messages: " << messages << " add: " << cb.adds
+              << " cancel: " << cb.cancels << " modify: " << cb.modifies
+              << " execution: " << cb.executions << std::endl;
+    if (profile)
+        profiler.Report(std::cout);
+    return 0;
 }
-// int main(int argc, char *argv[]) {
-//     if (argc != 3 || (std::string(argv[2]) != "fifo" && std::string(argv[2]) != "lifo")) {
-//         std::cerr << "Usage: " << argv[0] << " <input_file> <fifo|lifo>" << std::endl;
-//         return 1;
-//     }
-
-//     std::ifstream input_file(argv[1]);
-//     if (!input_file.is_open()) {
-//         std::cerr << "Error opening file: " << argv[1] << std::endl;
-//         return 1;
-//     }
-
-//     bool use_lifo = (std::string(argv[2]) == "lifo");
-
-//     auto trades = read_from_csv(input_file);
-//     auto pnl_records = calculate_pnl(trades, use_lifo);
-
-//     std::cout << "TIMESTAMP,SYMBOL,PNL" << std::endl;
-//     for (const auto &record : pnl_records) {
-//         std::cout << pnl_to_string(record) << std::endl;
-//     }
-
-//     return 0;
-// }
\ No newline at end of file
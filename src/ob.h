@@ -3,8 +3,10 @@
 #include "stream_msg.h"
 #include <cassert>
 #include <optional>
+#include <type_traits>
 #include <types.h>
 #include <variant>
+#include <vector>
 
 struct BidComparator {
     bool operator()(const double &lhs, const double &rhs) const {
@@ -21,10 +23,33 @@ struct AskComparator {
 template <typename LevelType, typename Comparator>
 using OneSideBook = std::map<double, LevelType, Comparator>;
 
+// queue priority of an order modified at the same price, a price change
+// always sends the order to the back of its new level
+enum class ModifyPriority {
+    // the order always goes to the back of the level
+    LoseAlways,
+    // keeps its place when the size goes down, loses it when it goes up
+    KeepOnDecrease,
+    // always keeps its place
+    KeepAlways,
+};
+
 template <typename LevelType> struct L3BookImpl {
     OneSideBook<LevelType, BidComparator> bids;
     OneSideBook<LevelType, AskComparator> asks;
     std::unordered_map<int, std::list<Order>::iterator> orderMap;
+    ModifyPriority modify_priority = ModifyPriority::LoseAlways;
+
+    // removed levels are kept out of the book as map nodes and reused for
+    // the next new price, so prices flickering at the touch do not free and
+    // reallocate the node and the level's containers each time. one list
+    // serves both sides, a node extracted from one map can be inserted into
+    // the other
+    using LevelNode = typename OneSideBook<LevelType, BidComparator>::node_type;
+    using AskNode = typename OneSideBook<LevelType, AskComparator>::node_type;
+    static_assert(std::is_same_v<LevelNode, AskNode>);
+    std::vector<LevelNode> free_levels;
+    size_t free_levels_capacity = 16;
 
     template <typename Func>
     void ProcessMsg(const Level3 &msg, Func &&callback) {
@@ -37,11 +62,8 @@ template <typename LevelType> struct L3BookImpl {
                     if (l)
                         callback(*l);
                 } else if constexpr (std::is_same_v<T, level3::Modify>) {
-                    auto l = Cancel(arg.order_id, arg.is_buy, 0);
-                    if (l)
-                        callback(*l);
-                    callback(
-                        Add(arg.order_id, arg.is_buy, arg.size, arg.price));
+                    Modify(arg.order_id, arg.is_buy, arg.size, arg.price,
+                           callback);
                 } else if constexpr (std::is_same_v<T, level3::Add>) {
                     callback(
                         Add(arg.order_id, arg.is_buy, arg.size, arg.price));
@@ -59,25 +81,52 @@ template <typename LevelType> struct L3BookImpl {
     LevelType &GetOrAddLevel(bool is_bid, double price) {
         if (is_bid) {
             auto it = bids.find(price);
-            if (it == bids.end()) {
-                auto &l = bids[price];
-                l.is_bid = is_bid;
-                l.price = price;
-                return l;
-            }
+            if (it == bids.end())
+                return NewLevel(bids, is_bid, price);
             return it->second;
         } else {
             auto it = asks.find(price);
-            if (it == asks.end()) {
-                auto &l = asks[price];
-                l.is_bid = is_bid;
-                l.price = price;
-                return l;
-            }
+            if (it == asks.end())
+                return NewLevel(asks, is_bid, price);
             return it->second;
         }
     }
 
+    template <typename Side>
+    LevelType &NewLevel(Side &side, bool is_bid, double price) {
+        if (free_levels.empty()) {
+            auto &l = side[price];
+            l.is_bid = is_bid;
+            l.price = price;
+            return l;
+        }
+        auto node = std::move(free_levels.back());
+        free_levels.pop_back();
+        node.key() = price;
+        auto &l = node.mapped();
+        l.Reset();
+        l.is_bid = is_bid;
+        l.price = price;
+        return side.insert(std::move(node)).position->second;
+    }
+
+    // erases the level without touching orderMap, returns the next level
+    template <typename Side>
+    typename Side::iterator EraseLevel(Side &side,
+                                       typename Side::iterator it) {
+        if (free_levels.size() >= free_levels_capacity)
+            return side.erase(it);
+        auto next = std::next(it);
+        free_levels.push_back(side.extract(it));
+        return next;
+    }
+
+    void SetFreeLevelsCapacity(size_t capacity) {
+        free_levels_capacity = capacity;
+        if (free_levels.size() > capacity)
+            free_levels.resize(capacity);
+    }
+
     void RemoveLevel(bool is_bid, double price) {
         if (is_bid) {
             auto it = bids.find(price);
@@ -85,7 +134,7 @@ template <typename LevelType> struct L3BookImpl {
             for (auto &order : it->second.orders) {
                 orderMap.erase(order.orderId);
             }
-            bids.erase(price);
+            EraseLevel(bids, it);
 
         } else {
             auto it = asks.find(price);
@@ -93,7 +142,7 @@ template <typename LevelType> struct L3BookImpl {
             for (auto &order : it->second.orders) {
                 orderMap.erase(order.orderId);
             }
-            asks.erase(it);
+            EraseLevel(asks, it);
         }
     }
 
@@ -107,6 +156,57 @@ template <typename LevelType> struct L3BookImpl {
         return level;
     }
 
+    // modifies the order in place: the list node is moved between levels
+    // with splice instead of being freed and reallocated, and orderMap keeps
+    // pointing at it. callback is called with each level that changed
+    template <typename Func>
+    void Modify(int order_id, bool is_bid, int new_size, double new_price,
+                Func &&callback) {
+        auto it = orderMap.find(order_id);
+        if (it == orderMap.end()) {
+            // a modify to 0 of an order we never saw has nothing to cancel,
+            // adding it would leave an empty order on the book
+            if (new_size > 0)
+                callback(Add(order_id, is_bid, new_size, new_price));
+            return;
+        }
+        if (new_size == 0) {
+            callback(*Cancel(order_id, is_bid, 0));
+            return;
+        }
+
+        auto orderIt = it->second;
+        assert(is_bid == orderIt->is_buy);
+        auto &level = GetOrAddLevel(is_bid, orderIt->price);
+
+        if (orderIt->price == new_price) {
+            bool keep =
+                modify_priority == ModifyPriority::KeepAlways ||
+                (modify_priority == ModifyPriority::KeepOnDecrease &&
+                 new_size <= orderIt->size);
+            level.qty += new_size - orderIt->size;
+            orderIt->size = new_size;
+            if (!keep)
+                level.orders.splice(level.orders.end(), level.orders,
+                                    orderIt);
+            callback(level);
+            return;
+        }
+
+        auto &new_level = GetOrAddLevel(is_bid, new_price);
+        level.qty -= orderIt->size;
+        level.numOrders--;
+        assert(level.qty >= 0);
+        orderIt->size = new_size;
+        orderIt->price = new_price;
+        new_level.orders.splice(new_level.orders.end(), level.orders, orderIt);
+        new_level.qty += new_size;
+        new_level.numOrders++;
+        // the old level may be removed by the callback, new_level stays valid
+        callback(level);
+        callback(new_level);
+    }
+
     LevelType *Execute(int order_id, bool is_bid,
                                        int exec_size) {
         // Execute an order in the L3 book
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <reader.h>
+#include <smart_ob.h>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware performance counters around SmartL3Book entry points.
+//
+// The counters are opened as one perf_event group so a single read() returns
+// all of them. Counters the kernel refuses (containers, perf_event_paranoid,
+// virtualized PMU) are left out of the group, and when none can be opened the
+// profiler falls back to wall clock only.
+
+enum PerfCounter {
+    Cycles,
+    Instructions,
+    L1dMisses,
+    LlcMisses,
+    BranchMisses,
+    kNumPerfCounters
+};
+
+inline const char *PerfCounterName(int c) {
+    static const char *names[kNumPerfCounters] = {
+        "cycles", "instructions", "l1d_miss", "llc_miss", "branch_miss"};
+    return names[c];
+}
+
+using PerfValues = std::array<uint64_t, kNumPerfCounters>;
+
+// free running values of the group and how long it was enabled and
+// actually counting, which differ when the PMU multiplexes it
+struct PerfSample {
+    PerfValues values{};
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+};
+
+// counts between two samples, scaled up by enabled / running time when the
+// group was only scheduled part of the time. false if it never ran in
+// between, the counts are then meaningless
+inline bool PerfDelta(const PerfSample &before, const PerfSample &after,
+                      PerfValues &delta) {
+    uint64_t enabled = after.time_enabled - before.time_enabled;
+    uint64_t running = after.time_running - before.time_running;
+    if (!running)
+        return false;
+    for (int c = 0; c < kNumPerfCounters; c++) {
+        uint64_t d = after.values[c] - before.values[c];
+        delta[c] = running < enabled
+                       ? static_cast<uint64_t>(static_cast<double>(d) *
+                                               enabled / running)
+                       : d;
+    }
+    return true;
+}
+
+struct PerfCounterGroup {
+    PerfCounterGroup() {
+        slot.fill(-1);
+#ifdef __linux__
+        for (int c = 0; c < kNumPerfCounters; c++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            Describe(c, attr);
+            attr.disabled = leader < 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                               PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            int fd = static_cast<int>(
+                syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fd < 0) {
+                if (error.empty())
+                    error = std::string(PerfCounterName(c)) + ": " +
+                            std::strerror(errno);
+                continue;
+            }
+            if (leader < 0)
+                leader = fd;
+            fds[num_open] = fd;
+            slot[c] = num_open++;
+        }
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#else
+        error = "perf_event_open is linux only";
+#endif
+    }
+
+    ~PerfCounterGroup() {
+#ifdef __linux__
+        for (int i = 0; i < num_open; i++)
+            close(fds[i]);
+#endif
+    }
+
+    PerfCounterGroup(const PerfCounterGroup &) = delete;
+    PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+    bool Available() const { return num_open > 0; }
+    bool Available(int c) const { return slot[c] >= 0; }
+    // why the first unavailable counter could not be opened
+    const std::string &Error() const { return error; }
+
+    // current free running values, 0 for unavailable counters. times stay 0
+    // when the group cannot be read
+    PerfSample Read() const {
+        PerfSample sample;
+#ifdef __linux__
+        if (leader < 0)
+            return sample;
+        // nr, time_enabled, time_running, values
+        uint64_t buf[3 + kNumPerfCounters];
+        if (read(leader, buf, sizeof(buf)) < 0)
+            return sample;
+        sample.time_enabled = buf[1];
+        sample.time_running = buf[2];
+        for (int c = 0; c < kNumPerfCounters; c++) {
+            if (slot[c] >= 0 && static_cast<uint64_t>(slot[c]) < buf[0])
+                sample.values[c] = buf[3 + slot[c]];
+        }
+#endif
+        return sample;
+    }
+
+  private:
+#ifdef __linux__
+    static void Describe(int c, perf_event_attr &attr) {
+        auto cache = [](uint64_t id, uint64_t op, uint64_t result) {
+            return id | (op << 8) | (result << 16);
+        };
+        switch (c) {
+        case Cycles:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case Instructions:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case L1dMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config =
+                cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS);
+            break;
+        case LlcMisses:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case BranchMisses:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        }
+    }
+#endif
+
+    int leader = -1;
+    int num_open = 0;
+    std::array<int, kNumPerfCounters> fds{};
+    // position of each counter in the group read, -1 if unavailable
+    std::array<int, kNumPerfCounters> slot{};
+    std::string error;
+};
+
+enum MsgKind {
+    L3Add,
+    L3Modify,
+    L3Cancel,
+    L3Execute,
+    L2Snapshot,
+    TradeMsg,
+    kNumMsgKinds
+};
+
+inline const char *MsgKindName(int k) {
+    static const char *names[kNumMsgKinds] = {"l3_add",    "l3_modify",
+                                              "l3_cancel", "l3_execute",
+                                              "l2",        "trade"};
+    return names[k];
+}
+
+inline MsgKind MsgKindOf(const Level3 &msg) {
+    return std::visit(
+        [](auto &&arg) {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, level3::Execute>)
+                return L3Execute;
+            else if constexpr (std::is_same_v<T, level3::Modify>)
+                return L3Modify;
+            else if constexpr (std::is_same_v<T, level3::Add>)
+                return L3Add;
+            else
+                return L3Cancel;
+        },
+        msg.msg);
+}
+
+struct PerfStats {
+    uint64_t count = 0;
+    uint64_t wall_ns = 0;
+    // measurements the counter group ran for, totals only cover those
+    uint64_t counted = 0;
+    // of which the group was multiplexed and the counts were scaled
+    uint64_t scaled = 0;
+    PerfValues totals{};
+};
+
+// wraps the SmartL3Book entry points and aggregates counters per message kind
+struct BookProfiler {
+    template <typename Func> void Measure(MsgKind kind, Func &&f) {
+        auto before = counters.Read();
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        auto t1 = std::chrono::steady_clock::now();
+        auto after = counters.Read();
+
+        auto &s = stats[kind];
+        s.count++;
+        s.wall_ns +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)
+                .count();
+        PerfValues delta;
+        if (!PerfDelta(before, after, delta))
+            return;
+        s.counted++;
+        s.scaled += after.time_running - before.time_running <
+                    after.time_enabled - before.time_enabled;
+        for (int c = 0; c < kNumPerfCounters; c++)
+            s.totals[c] += delta[c];
+    }
+
+    template <typename Book> void UpdateL3(Book &book, const Level3 &msg) {
+        Measure(MsgKindOf(msg), [&] { book.UpdateL3(msg); });
+    }
+    template <typename Book> void UpdateL2(Book &book, const Snapshot &msg) {
+        Measure(L2Snapshot, [&] { book.UpdateL2(msg); });
+    }
+    template <typename Book> void UpdateTrade(Book &book, const Trade &msg) {
+        Measure(TradeMsg, [&] { book.UpdateTrade(msg); });
+    }
+    template <typename Book> void Dispatch(Book &book, const StreamMsg &msg) {
+        std::visit(
+            [&](auto &&arg) {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, Level3>)
+                    UpdateL3(book, arg);
+                else if constexpr (std::is_same_v<T, Snapshot>)
+                    UpdateL2(book, arg);
+                else
+                    UpdateTrade(book, arg);
+            },
+            msg);
+    }
+
+    // per message kind averages, counters the kernel refused or never
+    // scheduled print as n/a
+    void Report(std::ostream &os) const {
+        if (!counters.Available())
+            os << "perf counters unavailable (" << counters.Error()
+               << "), wall clock only\n";
+        else if (!counters.Error().empty())
+            os << "some perf counters unavailable (" << counters.Error()
+               << ")\n";
+
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-11s %10s %10s", "msg", "count",
+                      "ns/msg");
+        os << line;
+        for (int c = 0; c < kNumPerfCounters; c++) {
+            std::snprintf(line, sizeof(line), " %12s", PerfCounterName(c));
+            os << line;
+        }
+        std::snprintf(line, sizeof(line), " %6s %7s\n", "ipc", "scaled");
+        os << line;
+
+        for (int k = 0; k < kNumMsgKinds; k++) {
+            const auto &s = stats[k];
+            if (!s.count)
+                continue;
+            double n = static_cast<double>(s.count);
+            std::snprintf(line, sizeof(line), "%-11s %10llu %10.1f",
+                          MsgKindName(k),
+                          static_cast<unsigned long long>(s.count),
+                          s.wall_ns / n);
+            os << line;
+            // the counter averages only cover the measurements they ran for
+            n = static_cast<double>(s.counted);
+            for (int c = 0; c < kNumPerfCounters; c++) {
+                if (counters.Available(c) && s.counted)
+                    std::snprintf(line, sizeof(line), " %12.1f",
+                                  s.totals[c] / n);
+                else
+                    std::snprintf(line, sizeof(line), " %12s", "n/a");
+                os << line;
+            }
+            if (counters.Available(Cycles) &&
+                counters.Available(Instructions) && s.totals[Cycles])
+                std::snprintf(line, sizeof(line), " %6.2f",
+                              static_cast<double>(s.totals[Instructions]) /
+                                  s.totals[Cycles]);
+            else
+                std::snprintf(line, sizeof(line), " %6s", "n/a");
+            os << line;
+            if (s.counted)
+                std::snprintf(line, sizeof(line), " %6.1f%%",
+                              100.0 * s.scaled / s.counted);
+            else
+                std::snprintf(line, sizeof(line), " %7s", "n/a");
+            os << line << "\n";
+        }
+    }
+
+    const PerfStats &Stats(MsgKind kind) const { return stats[kind]; }
+    const PerfCounterGroup &Counters() const { return counters; }
+
+  private:
+    PerfCounterGroup counters;
+    std::array<PerfStats, kNumMsgKinds> stats{};
+};
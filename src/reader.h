@@ -1,50 +1,182 @@
-// #pragma once
-// #include <algorithm>
-// #include <fstream>
-// #include <iomanip>
-// #include <sstream>
-// #include <string>
-// #include <vector>
-
-// #include "types.h"
-
-// inline std::vector<Trade> read_from_csv(std::istream &input) {
-//     std::vector<Trade> trades;
-
-//     // TIMESTAMP,SYMBOL,BUY_OR_SELL,PRICE,QUANTITY
-//     // 101,TFS,B,11.00,15
-//     // 102,TFS,B,12.50,15
-//     // 103,TFS,S,13.00,20
-//     // 104,TFS,S,12.75,10
-
-//     std::string line;
-//     std::getline(input, line);  // skip header
-
-//     while (std::getline(input, line)) {
-//         std::istringstream ss(line);
-//         Trade trade;
-//         std::string ts, buy_sell, price, size;
-
-//         std::getline(ss, ts, ',');
-//         std::getline(ss, trade.symbol, ',');
-//         std::getline(ss, buy_sell, ',');
-//         std::getline(ss, price, ',');
-//         std::getline(ss, size);
-
-//         trade.ts = std::stoi(ts);
-//         trade.side = (buy_sell == "S");
-//         trade.price = std::stod(price);
-//         trade.size = std::stoi(size);
-
-//         trades.push_back(trade);
-//     }
-
-//     return trades;
-// }
-
-// inline std::string pnl_to_string(const PnlRecord &record) {
-//     // e.g. 104,TFS,2.50
-//     std::stringstream ss;
-//     ss << record.ts << "," << record.symbol << "," << std::fixed << std::setprecision(2) << record.pnl;
-//     return ss.str();
-// }
\ No newline at end of file
+#pragma once
+#include <charconv>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "stream_msg.h"
+
+// Capture file format, one message per line, fields separated by ','.
+// Blank lines and lines starting with '#' are skipped. Sides are B or S.
+//
+// L3,<seq_id>,ADD,<order_id>,<side>,<size>,<price>
+// L3,<seq_id>,MODIFY,<order_id>,<side>,<size>,<price>
+// L3,<seq_id>,CANCEL,<order_id>,<side>
+// L3,<seq_id>,EXEC,<order_id>,<side>,<size>
+// L2,<seq_id>,<bids>,<asks>       levels as price:qty separated by ';'
+// TRADE,<seq_id>,<side>,<price>,<size>
+
+using StreamMsg = std::variant<Level3, Snapshot, Trade>;
+
+inline std::vector<std::string> SplitFields(const std::string &line,
+                                            char sep) {
+    std::vector<std::string> fields;
+    std::istringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, sep))
+        fields.push_back(field);
+    // keep a trailing empty field, e.g. an empty ask side
+    if (!line.empty() && line.back() == sep)
+        fields.emplace_back();
+    return fields;
+}
+
+inline std::vector<L2PriceLevel> ParseLevels(const std::string &field) {
+    std::vector<L2PriceLevel> levels;
+    for (const auto &level : SplitFields(field, ';')) {
+        auto pos = level.find(':');
+        if (pos == std::string::npos)
+            continue;
+        levels.push_back(L2PriceLevel{std::stod(level.substr(0, pos)),
+                                      std::stoi(level.substr(pos + 1))});
+    }
+    return levels;
+}
+
+// parse one capture line, returns false for blank/comment/malformed lines
+inline bool ParseMessage(const std::string &line, StreamMsg &msg) {
+    if (line.empty() || line[0] == '#')
+        return false;
+    auto f = SplitFields(line, ',');
+    if (f.size() < 2)
+        return false;
+
+    try {
+        int seq_id = std::stoi(f[1]);
+        if (f[0] == "L3" && f.size() >= 5) {
+            int order_id = std::stoi(f[3]);
+            bool is_buy = f[4] == "B";
+            if (f[2] == "ADD" && f.size() >= 7) {
+                msg = Level3{seq_id, level3::Add{order_id, is_buy,
+                                                 std::stoi(f[5]),
+                                                 std::stod(f[6])}};
+            } else if (f[2] == "MODIFY" && f.size() >= 7) {
+                msg = Level3{seq_id, level3::Modify{order_id, is_buy,
+                                                    std::stoi(f[5]),
+                                                    std::stod(f[6])}};
+            } else if (f[2] == "CANCEL") {
+                msg = Level3{seq_id, level3::Cancel{order_id, is_buy}};
+            } else if (f[2] == "EXEC" && f.size() >= 6) {
+                msg = Level3{seq_id, level3::Execute{order_id, is_buy,
+                                                     std::stoi(f[5])}};
+            } else {
+                return false;
+            }
+        } else if (f[0] == "L2" && f.size() >= 4) {
+            msg = Snapshot{seq_id, ParseLevels(f[2]), ParseLevels(f[3])};
+        } else if (f[0] == "TRADE" && f.size() >= 5) {
+            msg = Trade{seq_id, f[2] == "B", std::stod(f[3]), std::stoi(f[4])};
+        } else {
+            return false;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    return true;
+}
+
+// read the next message from a capture stream, false at end of stream
+inline bool ReadMessage(std::istream &input, StreamMsg &msg) {
+    std::string line;
+    while (std::getline(input, line)) {
+        if (ParseMessage(line, msg))
+            return true;
+    }
+    return false;
+}
+
+// shortest form that parses back to the same double
+inline void AppendCapturePrice(std::string &out, double price) {
+    char buf[32];
+    auto r = std::to_chars(buf, buf + sizeof(buf), price);
+    out.append(buf, r.ptr);
+}
+
+inline void AppendCaptureLevels(std::string &out,
+                                const std::vector<L2PriceLevel> &levels) {
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (i)
+            out += ';';
+        AppendCapturePrice(out, levels[i].price);
+        out += ':' + std::to_string(levels[i].qty);
+    }
+}
+
+// the capture line of a message, without the newline. ParseMessage reads it
+// back to the same message
+inline std::string FormatMessage(const StreamMsg &msg) {
+    std::string out;
+    auto side = [](bool is_buy) { return is_buy ? ",B" : ",S"; };
+    std::visit(
+        [&](auto &&arg) {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, Level3>) {
+                out = "L3," + std::to_string(arg.seq_id);
+                std::visit(
+                    [&](auto &&m) {
+                        using M = std::decay_t<decltype(m)>;
+                        if constexpr (std::is_same_v<M, level3::Add> ||
+                                      std::is_same_v<M, level3::Modify>) {
+                            out += std::is_same_v<M, level3::Add> ? ",ADD,"
+                                                                  : ",MODIFY,";
+                            out += std::to_string(m.order_id) +
+                                   side(m.is_buy) + ',' +
+                                   std::to_string(m.size) + ',';
+                            AppendCapturePrice(out, m.price);
+                        } else if constexpr (std::is_same_v<M,
+                                                            level3::Cancel>) {
+                            out += ",CANCEL," + std::to_string(m.order_id) +
+                                   side(m.is_buy);
+                        } else {
+                            out += ",EXEC," + std::to_string(m.order_id) +
+                                   side(m.is_buy) + ',' +
+                                   std::to_string(m.size);
+                        }
+                    },
+                    arg.msg);
+            } else if constexpr (std::is_same_v<T, Snapshot>) {
+                out = "L2," + std::to_string(arg.seq_id) + ',';
+                AppendCaptureLevels(out, arg.bids);
+                out += ',';
+                AppendCaptureLevels(out, arg.asks);
+            } else {
+                out = "TRADE," + std::to_string(arg.seq_id) +
+                      side(arg.is_buy) + ',';
+                AppendCapturePrice(out, arg.price);
+                out += ',' + std::to_string(arg.size);
+            }
+        },
+        msg);
+    return out;
+}
+
+// feed a message to the matching SmartL3Book entry point, messages of a
+// stream the book was built without are dropped
+template <typename Book> void Dispatch(Book &book, const StreamMsg &msg) {
+    std::visit(
+        [&book](auto &&arg) {
+            using T = std::decay_t<decltype(arg)>;
+            if constexpr (std::is_same_v<T, Level3>) {
+                book.UpdateL3(arg);
+            } else if constexpr (std::is_same_v<T, Snapshot>) {
+                if constexpr (requires { book.UpdateL2(arg); })
+                    book.UpdateL2(arg);
+            } else {
+                if constexpr (requires { book.UpdateTrade(arg); })
+                    book.UpdateTrade(arg);
+            }
+        },
+        msg);
+}
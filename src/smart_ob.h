@@ -2,84 +2,223 @@
 
 #include <algorithm>
 #include <callback.h>
+#include <charconv>
 #include <cmath>
 #include <deque>
+#include <frozen_book.h>
 #include <functional>
 #include <iostream>
+#include <level_soa.h>
 #include <limits>
+#include <memory>
 #include <ob.h>
+#include <optional>
 #include <stream_msg.h>
 #include <string>
+#include <type_traits>
 #include <types.h>
+#include <utility>
+
+// formats like std::to_string(double), without the temporary string
+inline void AppendPrice(std::string &out, double price) {
+    char buf[64];
+    auto r = std::to_chars(buf, buf + sizeof(buf), price,
+                           std::chars_format::fixed, 6);
+    out.append(buf, r.ptr);
+}
+
+inline void AppendInt(std::string &out, int value) {
+    char buf[16];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, r.ptr);
+}
+
+// appends "price:[size@id, ...]" with the orders for_each(f) calls f with
+template <typename ForEach>
+void AppendLevel(std::string &out, double price, ForEach &&for_each) {
+    AppendPrice(out, price);
+    out += ":[";
+    bool flag = false;
+    for_each([&](const Order &order) {
+        if (flag)
+            out += ", ";
+        flag = true;
+        AppendInt(out, order.size);
+        out += '@';
+        AppendInt(out, order.orderId);
+    });
+    out += "]";
+}
+
+// the estimated orders of a level: its L3 orders are trimmed at the front or
+// topped up with a guessed order to l2_qty, then the unconfirmed trades are
+// removed from the back. shared by live and frozen levels
+struct OrderEstimate {
+    bool is_bid;
+    double price;
+    int qty;
+    int l2_qty;
+    int unconfirmed_trade_qty;
+
+    int Qty() const { return std::max(0, l2_qty - unconfirmed_trade_qty); }
+
+    // first..last yield the L3 orders (anything with orderId and size),
+    // calls f(const Order &) for each estimated order, front to back
+    template <typename It, typename Func>
+    void ForEach(It first, It last, Func &&f) const {
+        // removing the trades from the back is the same as capping the
+        // orders from the front to the estimated qty
+        int remaining_qty = Qty();
+        // cancel orders at the front
+        int should_cancel_qty = std::max(0, qty - l2_qty);
+        for (; first != last; ++first) {
+            if (!remaining_qty)
+                return;
+            const auto &order = *first;
+            if (order.size > should_cancel_qty) {
+                int size =
+                    std::min(order.size - should_cancel_qty, remaining_qty);
+                remaining_qty -= size;
+                should_cancel_qty = 0;
+                f(Order{order.orderId, is_bid, size, price});
+            } else {
+                should_cancel_qty -= order.size;
+            }
+        }
+        if (l2_qty > qty && remaining_qty) {
+            int guessed_qty = std::min(l2_qty - qty, remaining_qty);
+            f(Order{0, is_bid, guessed_qty, price});
+        }
+    }
+};
 
 const double EXEC_RATIO =
     0.3; // 30% of the level's quantity is executed, other canceled.
 
-struct L3SmartPriceLevel : L3PriceLevel {
+// Compile time features of the book. A disabled feature has no state (the
+// members become empty types) and no code (if constexpr), and its entry
+// point does not exist.
+struct FullBookPolicy {
+    // L2 snapshots (UpdateL2) confirm the level qty in l2_qty
+    static constexpr bool kL2Reconcile = true;
+    // the trade stream (UpdateTrade) and unconfirmed trades per level, and
+    // the EXEC_RATIO guess of executions from L2 decreases, which are
+    // reported as cancels without it
+    static constexpr bool kTradeInference = true;
+    // levels show the estimated orders instead of the L3 orders as received
+    static constexpr bool kEstimatedOrders = true;
+    static constexpr bool kOnOrderAdd = true;
+    static constexpr bool kOnOrderCancel = true;
+    static constexpr bool kOnOrderModify = true;
+    static constexpr bool kOnOrderExecution = true;
+};
+
+// a plain L3 book
+struct L3OnlyPolicy : FullBookPolicy {
+    static constexpr bool kL2Reconcile = false;
+    static constexpr bool kTradeInference = false;
+    static constexpr bool kEstimatedOrders = false;
+};
+
+// L2 snapshots plus trades, without an L3 stream there are no modifies
+struct L2TradePolicy : FullBookPolicy {
+    static constexpr bool kOnOrderModify = false;
+};
+
+// stands in for the state of a disabled feature, the tag keeps the empty
+// members of one class distinct so they all take no space. it has no value,
+// so feature members are initialized with {} and set under if constexpr
+template <int Tag> struct NoFeature {};
+
+template <bool Enabled, typename T, int Tag>
+using FeatureField = std::conditional_t<Enabled, T, NoFeature<Tag>>;
+
+template <typename Policy> struct L3SmartPriceLevelT : L3PriceLevel {
     // confirmed order quantity from l2 snapshot
-    int l2_qty = 0;
+    [[no_unique_address]] FeatureField<Policy::kL2Reconcile, int, 0> l2_qty{};
 
-    int total_unconfirmed_trade_qty = 0;
+    [[no_unique_address]] FeatureField<Policy::kTradeInference, int, 1>
+        total_unconfirmed_trade_qty{};
 
     // trade messages after the last L2 or L3 update
-    std::deque<Trade> unconfirmed_trades;
+    [[no_unique_address]] FeatureField<Policy::kTradeInference,
+                                       std::deque<Trade>, 2>
+        unconfirmed_trades{};
+
+    // l2_qty, or the L3 qty without L2 reconciliation
+    int L2Qty() const {
+        if constexpr (Policy::kL2Reconcile)
+            return l2_qty;
+        else
+            return qty;
+    }
 
-    void PopUnconfirmedTradesBefore(int seq_id) {
-        while (!unconfirmed_trades.empty() &&
-               unconfirmed_trades.front().seq_id <= seq_id) {
-            total_unconfirmed_trade_qty -= unconfirmed_trades.front().size;
-            unconfirmed_trades.pop_front();
+    int UnconfirmedTradeQty() const {
+        if constexpr (Policy::kTradeInference)
+            return total_unconfirmed_trade_qty;
+        else
+            return 0;
+    }
+
+    // keeps the deque's storage, see L3BookImpl::free_levels
+    void Reset() {
+        L3PriceLevel::Reset();
+        if constexpr (Policy::kL2Reconcile)
+            l2_qty = 0;
+        if constexpr (Policy::kTradeInference) {
+            total_unconfirmed_trade_qty = 0;
+            unconfirmed_trades.clear();
         }
     }
 
-    std::vector<Order> GetOrders() const {
-        std::vector<Order> orders;
-        // cancel orders at the front
-        int should_cancel_qty = std::max(0, qty - l2_qty);
-        for (const auto &order : this->orders) {
-            if (order.size > should_cancel_qty) {
-                auto order_cpy = order;
-                order_cpy.size -= should_cancel_qty;
-                orders.push_back(order_cpy);
-                should_cancel_qty = 0;
-            } else {
-                should_cancel_qty -= order.size;
+    void PopUnconfirmedTradesBefore(int seq_id) {
+        if constexpr (Policy::kTradeInference) {
+            while (!unconfirmed_trades.empty() &&
+                   unconfirmed_trades.front().seq_id <= seq_id) {
+                total_unconfirmed_trade_qty -= unconfirmed_trades.front().size;
+                unconfirmed_trades.pop_front();
             }
         }
-        if (l2_qty > qty) {
-            int guessed_qty = l2_qty - qty;
-            Order guessed_order{0, is_bid, guessed_qty, price};
-            orders.push_back(guessed_order);
-        }
+    }
 
-        // remove the trades from behind
-        auto trade_remaining_qty = total_unconfirmed_trade_qty;
-        while (!orders.empty() && trade_remaining_qty > 0) {
-            if (orders.back().size <= trade_remaining_qty) {
-                trade_remaining_qty -= orders.back().size;
-                orders.pop_back();
-            } else {
-                orders.back().size -= trade_remaining_qty;
-                break; // no more trades to remove
-            }
+    OrderEstimate Estimate() const {
+        return OrderEstimate{is_bid, price, qty, L2Qty(),
+                             UnconfirmedTradeQty()};
+    }
+
+    // qty of the estimated orders, see OrderEstimate
+    int EstimatedQty() const {
+        if constexpr (Policy::kEstimatedOrders)
+            return Estimate().Qty();
+        else
+            return qty;
+    }
+
+    // calls f(const Order &) for each estimated order, front to back, same as
+    // GetOrders but without building a vector
+    template <typename Func> void ForEachOrder(Func &&f) const {
+        if constexpr (Policy::kEstimatedOrders) {
+            Estimate().ForEach(this->orders.begin(), this->orders.end(), f);
+        } else {
+            for (const auto &order : this->orders)
+                f(order);
         }
+    }
+
+    std::vector<Order> GetOrders() const {
+        std::vector<Order> orders;
+        ForEachOrder([&orders](const Order &order) { orders.push_back(order); });
         return orders;
     }
 
+    // appends the level to out, reusing its capacity
+    void Render(std::string &out) const {
+        AppendLevel(out, price, [this](auto &&f) { ForEachOrder(f); });
+    }
+
     std::string ToString() const {
-        std::string result = std::to_string(price);
-        // result += "," + std::to_string(qty) + "," + std::to_string(l2_qty) +
-        //           "," + std::to_string(total_unconfirmed_trade_qty);
-        result += ":[";
-        bool flag = false;
-        for (const auto &order : GetOrders()) {
-            if (flag)
-                result += ", ";
-            flag = true;
-            result += std::to_string(order.size) + '@' +
-                      std::to_string(order.orderId);
-        }
-        result += "]";
+        std::string result;
+        Render(result);
         return result;
     }
 
@@ -99,68 +238,60 @@ struct L3SmartPriceLevel : L3PriceLevel {
             assert(order.is_buy == is_bid);
             guessed_total_qty += order.size;
         }
-        assert(l2_qty - total_unconfirmed_trade_qty < 0 ||
-               l2_qty - total_unconfirmed_trade_qty == guessed_total_qty);
+        assert(!Policy::kEstimatedOrders ||
+               L2Qty() - UnconfirmedTradeQty() < 0 ||
+               L2Qty() - UnconfirmedTradeQty() == guessed_total_qty);
     }
 };
 
-struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
-    SmartL3Book(SmartObCallback *callback) : callback(callback) {}
+using L3SmartPriceLevel = L3SmartPriceLevelT<FullBookPolicy>;
+
+template <typename Policy>
+struct SmartL3BookT : private L3BookImpl<L3SmartPriceLevelT<Policy>> {
+    using Level = L3SmartPriceLevelT<Policy>;
+    using Callback = SmartObCallbackT<SmartL3BookT>;
+    using Observer = SmartObObserverT<SmartL3BookT>;
+    // for code templated on the book
+    using Features = Policy;
+
+    SmartL3BookT(Callback *callback) : callback(callback) {
+        if constexpr (Policy::kL2Reconcile)
+            kernels = &GetSoaKernels();
+        if constexpr (kCrossStream)
+            last_l2_best_ask = std::numeric_limits<double>::max();
+    }
 
-    void UpdateL2(const Snapshot &snapshot) {
+    void UpdateL2(const Snapshot &snapshot)
+        requires Policy::kL2Reconcile
+    {
         if (snapshot.seq_id <= last_l2_seq_id) {
             // Ignore updates that are older than the last l2/l3 update
             return;
         }
+        if (frozen)
+            Thaw();
+        BeginUpdate(snapshot.seq_id);
 
         std::vector<std::function<void()>> cb;
 
-        // TODO: change to pointer, no need to binary search...
-        for (auto &[p, l] : bids) {
-            if (!std::binary_search(snapshot.bids.begin(), snapshot.bids.end(),
-                                    L2PriceLevel{p, 0},
-                                    [](const auto &a, const auto &b) {
-                                        return a.price > b.price;
-                                    })) {
-
-                // the level is not in the snapshot, remove it
-                UpdateL2Level(snapshot.seq_id, 0, l, cb);
-                continue;
-            }
-        }
-        for (auto &[p, l] : asks) {
-            if (!std::binary_search(snapshot.asks.begin(), snapshot.asks.end(),
-                                    L2PriceLevel{p, 0},
-                                    [](const auto &a, const auto &b) {
-                                        return a.price < b.price;
-                                    })) {
-
-                // the level is not in the snapshot, remove it
-                UpdateL2Level(snapshot.seq_id, 0, l, cb);
-                continue;
+        // diff both sides against the snapshot in SoA form, the matched
+        // levels are then updated through pointers instead of tree lookups
+        DiffSide(bids, snapshot.bids, true, bid_diff);
+        DiffSide(asks, snapshot.asks, false, ask_diff);
+
+        // the levels not in the snapshot, remove them
+        for (auto *d : {&bid_diff, &ask_diff}) {
+            for (size_t i = 0; i < d->levels.size(); i++) {
+                if (d->diff.book_to_snap[i] < 0)
+                    UpdateL2Level(snapshot.seq_id, 0, d->diff.l2_deltas[i],
+                                  *d->levels[i], cb);
             }
+            for (auto *level : d->beyond)
+                UpdateL2Level(snapshot.seq_id, 0, -level->l2_qty, *level, cb);
         }
 
-        // std::cout << "### " << bids.count(100.0) << std::endl;
-        // std::cout << "###"; for (auto &[k, v]: bids) std::cout << k << " ";
-        // std::cout << std::endl;
-
-        for (auto &l2_level : snapshot.bids) {
-            auto &level = GetOrAddLevel(true, l2_level.price);
-            // std::cout << "<<<< " << level.price << " " << level.qty << "," <<
-            // level.l2_qty << std::endl;
-            UpdateL2Level(snapshot.seq_id, l2_level.qty, level, cb);
-            // std::cout << "<<<< " << level.price << " " << level.qty << "," <<
-            // level.l2_qty << std::endl;
-        }
-        for (auto &l2_level : snapshot.asks) {
-            auto &level = GetOrAddLevel(false, l2_level.price);
-            // std::cout << "<<<< " << level.price << " " << level.qty << "," <<
-            // level.l2_qty << std::endl;
-            UpdateL2Level(snapshot.seq_id, l2_level.qty, level, cb);
-            // std::cout << "<<<< " << level.price << " " << level.qty << "," <<
-            // level.l2_qty << std::endl;
-        }
+        ApplySide(snapshot.seq_id, snapshot.bids, true, bid_diff, cb);
+        ApplySide(snapshot.seq_id, snapshot.asks, false, ask_diff, cb);
 
         last_l2_seq_id = snapshot.seq_id;
 
@@ -168,27 +299,102 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
         for (auto &f : cb) {
             f();
         }
+        NotifyObservers();
+    }
+
+    // scratch of the snapshot diff of one side, reused across updates
+    struct L2SideDiff {
+        // the book levels within the price range of the snapshot
+        std::vector<Level *> levels;
+        // the ones behind its last level, none of them can match
+        std::vector<Level *> beyond;
+        LevelSoA book;
+        LevelSoA snapshot;
+        SideDiff diff;
+    };
+
+    // only the book levels up to the snapshot's last price go through the
+    // kernels. the snapshot replaces the whole side, so the levels behind it
+    // are still visited, to be removed
+    template <typename Side>
+    void DiffSide(Side &side, const std::vector<L2PriceLevel> &l2_levels,
+                  bool is_bid, L2SideDiff &d) {
+        d.levels.clear();
+        d.beyond.clear();
+        d.book.Clear();
+        d.snapshot.Clear();
+        auto it = side.begin();
+        if (!l2_levels.empty()) {
+            auto last = l2_levels.back().price;
+            for (; it != side.end() && !side.key_comp()(last, it->first);
+                 ++it) {
+                d.levels.push_back(&it->second);
+                d.book.Push(it->first, it->second.l2_qty);
+            }
+        }
+        for (; it != side.end(); ++it)
+            d.beyond.push_back(&it->second);
+        for (auto &l : l2_levels)
+            d.snapshot.Push(l.price, l.qty);
+        d.diff.Compute(*kernels, d.book, d.snapshot, is_bid);
+    }
+
+    // the matched levels take their precomputed delta, the new ones start
+    // from no l2 qty
+    void ApplySide(int seq_id, const std::vector<L2PriceLevel> &l2_levels,
+                   bool is_bid, L2SideDiff &d,
+                   std::vector<std::function<void()>> &cb) {
+        for (size_t j = 0; j < l2_levels.size(); j++) {
+            auto i = d.diff.snap_to_book[j];
+            if (i >= 0) {
+                UpdateL2Level(seq_id, l2_levels[j].qty, d.diff.l2_deltas[i],
+                              *d.levels[i], cb);
+                continue;
+            }
+            auto &level = GetOrAddLevel(is_bid, l2_levels[j].price);
+            UpdateL2Level(seq_id, l2_levels[j].qty,
+                          l2_levels[j].qty - level.l2_qty, level, cb);
+        }
+    }
+
+    // queue priority rule of the venue for modified orders
+    void SetModifyPriority(ModifyPriority priority) {
+        this->modify_priority = priority;
     }
 
-    void UpdateL2Level(int seq_id, int l2_qty, L3SmartPriceLevel &level,
+    // number of removed levels kept for reuse, 0 frees them right away
+    void SetLevelRecycling(size_t capacity) {
+        this->SetFreeLevelsCapacity(capacity);
+    }
+
+    // override the runtime selected SoA kernels, e.g. to force scalar
+    void SetSoaKernels(const SoaKernels &k)
+        requires Policy::kL2Reconcile
+    {
+        kernels = &k;
+    }
+
+    // delta is l2_qty - level.l2_qty
+    void UpdateL2Level(int seq_id, int l2_qty, int delta, Level &level,
                        std::vector<std::function<void()>> &cb) {
         assert(seq_id > last_l3_seq_id);
-
-        int delta = l2_qty - level.l2_qty;
+        assert(delta == l2_qty - level.l2_qty);
         auto price = level.price;
         auto is_bid = level.is_bid;
 
         if (delta > 0) {
-            cb.push_back([=, this] {
-                callback->onOrderAdd(*this, OrderInfo{0, is_bid, delta, price});
-            });
+            if constexpr (Policy::kOnOrderAdd)
+                cb.push_back([=, this] {
+                    callback->onOrderAdd(*this,
+                                         OrderInfo{0, is_bid, delta, price});
+                });
 
-        } else {
+        } else if constexpr (Policy::kTradeInference) {
             if (seq_id <= std::max(last_trade_ask_id, last_trade_bid_id)) {
                 // the change between last l2 update and this one is fully due
                 // to canceling OnOrderCancel(-delta, level.price,
                 // level.is_bid);
-                if (delta)
+                if (delta && Policy::kOnOrderCancel)
                     cb.push_back([=, this] {
                         callback->onOrderCancel(
                             *this, OrderInfo{0, is_bid, -delta, price});
@@ -200,62 +406,85 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
                                level.total_unconfirmed_trade_qty;
                 int cancel_qty = std::abs(delta) - exec_qty;
                 cb.push_back([=, this] {
-                    if (exec_qty)
-                        callback->onOrderExecution(
-                            *this, OrderInfo{0, is_bid, exec_qty, price});
-                    if (cancel_qty)
-                        callback->onOrderCancel(
-                            *this, OrderInfo{0, is_bid, cancel_qty, price});
+                    if constexpr (Policy::kOnOrderExecution)
+                        if (exec_qty)
+                            callback->onOrderExecution(
+                                *this, OrderInfo{0, is_bid, exec_qty, price});
+                    if constexpr (Policy::kOnOrderCancel)
+                        if (cancel_qty)
+                            callback->onOrderCancel(
+                                *this, OrderInfo{0, is_bid, cancel_qty, price});
                 });
             }
             // NOTE: there maybe additional ADD + CANCEL pairs between these,
             // but there's no point to send them at this point...
+        } else {
+            // without trades every decrease is reported as a cancel
+            if (delta && Policy::kOnOrderCancel)
+                cb.push_back([=, this] {
+                    callback->onOrderCancel(
+                        *this, OrderInfo{0, is_bid, -delta, price});
+                });
         }
 
         level.l2_qty = l2_qty;
         level.PopUnconfirmedTradesBefore(seq_id);
+        Touch(level);
         return;
     }
 
     void UpdateL3(const Level3 &msg) {
+        // an L3 message that cannot change the book, e.g. a repeated cancel,
+        // leaves it hibernated
+        if (frozen && ChangesFrozen(msg))
+            Thaw();
+        BeginUpdate(msg.seq_id);
 
-        ProcessMsg(msg, [this, seq_id = msg.seq_id](auto &level) {
+        this->ProcessMsg(msg, [this, seq_id = msg.seq_id](auto &level) {
             ReconcileL3(seq_id, level);
         });
 
-        if (msg.seq_id < last_l2_seq_id) {
-            CancelLevels(true, last_l2_best_bid, false);
-            CancelLevels(false, last_l2_best_ask, false);
-        }
-        if (msg.seq_id <= last_trade_bid_id) {
-            CancelLevels(true, last_l2_best_bid, false);
+        if constexpr (Policy::kL2Reconcile) {
+            if (msg.seq_id < last_l2_seq_id) {
+                CancelLevels(true, last_l2_best_bid, false);
+                CancelLevels(false, last_l2_best_ask, false);
+            }
         }
-        if (msg.seq_id <= last_trade_ask_id) {
-            CancelLevels(false, last_l2_best_ask, false);
+        if constexpr (Policy::kTradeInference) {
+            if (msg.seq_id <= last_trade_bid_id) {
+                CancelLevels(true, last_l2_best_bid, false);
+            }
+            if (msg.seq_id <= last_trade_ask_id) {
+                CancelLevels(false, last_l2_best_ask, false);
+            }
         }
 
-        if (msg.seq_id >
-            std::max({last_l2_seq_id, last_trade_bid_id, last_trade_ask_id})) {
+        if (NewerThanOtherStreams(msg.seq_id)) {
 
             // pass through the level3 msg to the callback
             std::visit(
                 [this](auto &&arg) {
                     using T = std::decay_t<decltype(arg)>;
                     if constexpr (std::is_same_v<T, level3::Execute>) {
-                        callback->onOrderExecution(
-                            *this,
-                            OrderInfo{arg.order_id, arg.is_buy, arg.size, 0});
+                        if constexpr (Policy::kOnOrderExecution)
+                            callback->onOrderExecution(
+                                *this, OrderInfo{arg.order_id, arg.is_buy,
+                                                 arg.size, 0});
                     } else if constexpr (std::is_same_v<T, level3::Modify>) {
-                        callback->onOrderModify(
-                            *this, OrderInfo{arg.order_id, arg.is_buy, arg.size,
-                                             arg.price});
+                        if constexpr (Policy::kOnOrderModify)
+                            callback->onOrderModify(
+                                *this, OrderInfo{arg.order_id, arg.is_buy,
+                                                 arg.size, arg.price});
                     } else if constexpr (std::is_same_v<T, level3::Add>) {
-                        callback->onOrderAdd(*this,
-                                             OrderInfo{arg.order_id, arg.is_buy,
-                                                       arg.size, arg.price});
+                        if constexpr (Policy::kOnOrderAdd)
+                            callback->onOrderAdd(
+                                *this, OrderInfo{arg.order_id, arg.is_buy,
+                                                 arg.size, arg.price});
                     } else if constexpr (std::is_same_v<T, level3::Cancel>) {
-                        callback->onOrderCancel(
-                            *this, OrderInfo{arg.order_id, arg.is_buy, 0, 0});
+                        if constexpr (Policy::kOnOrderCancel)
+                            callback->onOrderCancel(
+                                *this,
+                                OrderInfo{arg.order_id, arg.is_buy, 0, 0});
                     } else {
                         assert(false && "Unknown message type");
                     }
@@ -264,12 +493,58 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
         }
 
         last_l3_seq_id = msg.seq_id;
-        last_l2_seq_id = std::max(last_l2_seq_id, msg.seq_id);
+        if constexpr (kCrossStream)
+            last_l2_seq_id = std::max(last_l2_seq_id, msg.seq_id);
+        NotifyObservers();
+    }
+
+    // false if the L3 message leaves a hibernated book as it is: it refers
+    // to an order the book does not have, and no other stream overtook it.
+    // a binary search of the frozen order ids
+    bool ChangesFrozen(const Level3 &msg) const {
+        if constexpr (Policy::kL2Reconcile) {
+            if (msg.seq_id < last_l2_seq_id)
+                return true;
+        }
+        if constexpr (Policy::kTradeInference) {
+            if (msg.seq_id <= std::max(last_trade_bid_id, last_trade_ask_id))
+                return true;
+        }
+        return std::visit(
+            [this](auto &&arg) {
+                using T = std::decay_t<decltype(arg)>;
+                if constexpr (std::is_same_v<T, level3::Add>)
+                    return true;
+                else {
+                    // a modify of an unknown order adds it
+                    if constexpr (std::is_same_v<T, level3::Modify>)
+                        if (arg.size > 0)
+                            return true;
+                    return frozen->HasOrder(arg.order_id);
+                }
+            },
+            msg.msg);
+    }
+
+    // the L3 message is the newest information on the book
+    bool NewerThanOtherStreams(int seq_id) const {
+        if constexpr (Policy::kTradeInference)
+            return seq_id > std::max({last_l2_seq_id, last_trade_bid_id,
+                                      last_trade_ask_id});
+        else if constexpr (Policy::kL2Reconcile)
+            return seq_id > last_l2_seq_id;
+        else
+            return true;
     }
 
-    void ReconcileL3(int seq_id, L3SmartPriceLevel &level) {
-        if (last_l2_seq_id <= seq_id) {
-            level.l2_qty = level.qty;
+    void ReconcileL3(int seq_id, Level &level) {
+        Touch(level);
+        bool newest = true;
+        if constexpr (kCrossStream)
+            newest = last_l2_seq_id <= seq_id;
+        if (newest) {
+            if constexpr (Policy::kL2Reconcile)
+                level.l2_qty = level.qty;
             level.PopUnconfirmedTradesBefore(seq_id);
             if (level.qty == 0) {
                 RemoveLevel(level.is_bid, level.price);
@@ -280,7 +555,7 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
     void CancelLevels(bool is_bid, double price, bool send_cancel) {
         // send cancel messages for all orders between the spread
         if (is_bid) {
-            if (send_cancel)
+            if (send_cancel && Policy::kOnOrderCancel)
                 for (auto &[p, l] : bids) {
                     if (p <= price)
                         break;
@@ -293,11 +568,14 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
 
             auto it = bids.begin();
             while (it != bids.end() && it->first > price) {
-                it = bids.erase(it);
+                for (auto &order : it->second.orders)
+                    orderMap.erase(order.orderId);
+                Touch(it->second);
+                it = EraseLevel(bids, it);
             }
 
         } else {
-            if (send_cancel)
+            if (send_cancel && Policy::kOnOrderCancel)
                 for (auto &[p, l] : asks) {
                     if (p >= price)
                         break;
@@ -310,17 +588,25 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
 
             auto it = asks.begin();
             while (it != asks.end() && it->first < price) {
-                it = asks.erase(it);
+                for (auto &order : it->second.orders)
+                    orderMap.erase(order.orderId);
+                Touch(it->second);
+                it = EraseLevel(asks, it);
             }
         }
     }
 
-    void UpdateTrade(const Trade &trade) {
+    void UpdateTrade(const Trade &trade)
+        requires Policy::kTradeInference
+    {
         // the trade is already received by l3 update or guessed by l2 update,
         // skip
         if (trade.seq_id <= last_l3_seq_id || trade.seq_id <= last_l2_seq_id) {
             return;
         }
+        if (frozen)
+            Thaw();
+        BeginUpdate(trade.seq_id);
 
         CancelLevels(trade.is_buy, trade.price, false);
 
@@ -330,44 +616,396 @@ struct SmartL3Book : private L3BookImpl<L3SmartPriceLevel> {
         level.unconfirmed_trades.push_back(trade);
         level.total_unconfirmed_trade_qty += trade.size;
         (trade.is_buy ? last_trade_bid_id : last_trade_ask_id) = trade.seq_id;
-        callback->onOrderExecution(
-            *this, OrderInfo{0, trade.is_buy, trade.size, trade.price});
+        Touch(level);
+        if constexpr (Policy::kOnOrderExecution)
+            callback->onOrderExecution(
+                *this, OrderInfo{0, trade.is_buy, trade.size, trade.price});
+        NotifyObservers();
     }
 
-    std::string ToString() const {
-        std::string result;
-        result += "BID:\n";
+    // renders the book into out, which is cleared first. pass the same
+    // string every time and rendering stops allocating once it is warm
+    void Render(std::string &out) const {
+        out.clear();
+        if (frozen) {
+            RenderFrozen(out);
+            return;
+        }
+        out += "BID:\n";
         for (const auto &[price, level] : bids) {
-            if (!level.GetOrders().empty())
-                result += level.ToString() + "\n";
+            if (level.EstimatedQty()) {
+                level.Render(out);
+                out += '\n';
+            }
         }
-        result += "ASK:\n";
+        out += "ASK:\n";
         for (const auto &[price, level] : asks) {
-            if (!level.GetOrders().empty())
-                result += level.ToString() + "\n";
+            if (level.EstimatedQty()) {
+                level.Render(out);
+                out += '\n';
+            }
         }
+    }
+
+    std::string ToString() const {
+        std::string result;
+        Render(result);
         return result;
     }
 
-    void DebugCheck() const {
-        for (const auto &[price, level] : bids) {
-            level.DebugCheck();
+    // calls f(const Level &) for the live levels of a side from the touch
+    // outwards, including levels without estimated orders, until f returns
+    // false. a hibernated book has none, see ForEachLevelView
+    template <typename Func> void ForEachLevel(bool is_bid, Func &&f) const {
+        if (is_bid) {
+            for (const auto &[price, level] : bids)
+                if (!f(level))
+                    return;
+        } else {
+            for (const auto &[price, level] : asks)
+                if (!f(level))
+                    return;
         }
-        for (const auto &[price, level] : asks) {
-            level.DebugCheck();
+    }
+
+    // seq_id of the message currently (or most recently) being applied, so
+    // callbacks can tag the events they receive
+    int CurrentSeqId() const { return cur_seq_id; }
+
+    // observers run after each applied update, in the order they were added
+    void AddObserver(Observer *observer) {
+        observers.push_back(observer);
+    }
+
+    // levels changed by the current update, each once, sorted by side then
+    // price. only tracked with observers, a level may no longer exist
+    const std::vector<LevelRef> &TouchedLevels() const { return touched; }
+
+    // the live level, a hibernated book has none, see FindLevelView
+    const Level *FindLevel(bool is_bid, double price) const {
+        if (is_bid) {
+            auto it = bids.find(price);
+            return it == bids.end() ? nullptr : &it->second;
+        }
+        auto it = asks.find(price);
+        return it == asks.end() ? nullptr : &it->second;
+    }
+
+    // the estimated orders of a live or a frozen level, what observers and
+    // other readers need whether or not the book is hibernated. valid until
+    // the next update
+    struct LevelView {
+        const SmartL3BookT *book;
+        // one of them is set
+        const Level *live;
+        const FrozenLevel *frozen;
+        bool is_bid;
+        double price;
+
+        int EstimatedQty() const {
+            return live ? live->EstimatedQty()
+                        : book->FrozenEstimatedQty(*frozen);
+        }
+
+        // calls f(const Order &) for each estimated order
+        template <typename Func> void ForEachOrder(Func &&f) const {
+            if (live)
+                live->ForEachOrder(f);
+            else
+                book->ForEachFrozenOrder(*frozen, is_bid, f);
+        }
+    };
+
+    std::optional<LevelView> FindLevelView(bool is_bid, double price) const {
+        if (frozen) {
+            if (auto *fl = frozen->FindLevel(is_bid, price))
+                return LevelView{this, nullptr, fl, is_bid, price};
+        } else if (auto *level = FindLevel(is_bid, price)) {
+            return LevelView{this, level, nullptr, is_bid, price};
+        }
+        return std::nullopt;
+    }
+
+    // ForEachLevel with f(const LevelView &), a hibernated book is read from
+    // the frozen form and stays hibernated
+    template <typename Func>
+    void ForEachLevelView(bool is_bid, Func &&f) const {
+        if (frozen) {
+            frozen->ForEachLevel(is_bid, [&](const FrozenLevel &fl) {
+                return f(LevelView{this, nullptr, &fl, is_bid, fl.price});
+            });
+            return;
+        }
+        ForEachLevel(is_bid, [&](const Level &level) {
+            return f(LevelView{this, &level, nullptr, is_bid, level.price});
+        });
+    }
+
+    // moves the book into a compact FrozenBook and releases the levels,
+    // orders, orderMap, recycled levels and scratch buffers. returns the
+    // bytes reclaimed, by MemoryUsage. the queries are served from the
+    // frozen form and the next update that changes the book thaws it
+    size_t Hibernate() {
+        if (frozen)
+            return 0;
+        auto before = MemoryUsage();
+        auto f = std::make_unique<FrozenBook>();
+        size_t num_orders = orderMap.size(), num_trades = 0;
+        for (bool is_bid : {true, false}) {
+            ForEachLevel(is_bid, [&](const Level &l) {
+                num_trades += NumTrades(l);
+                return true;
+            });
+        }
+        f->levels.reserve(bids.size() + asks.size());
+        f->orders.reserve(num_orders);
+        f->order_ids.reserve(num_orders);
+        f->trades.reserve(num_trades);
+        f->num_bids = bids.size();
+        for (bool is_bid : {true, false}) {
+            ForEachLevel(is_bid, [&](const Level &l) {
+                f->levels.push_back(FrozenLevel{
+                    l.price, l.qty, l.L2Qty(), l.UnconfirmedTradeQty(),
+                    static_cast<uint32_t>(f->orders.size()),
+                    static_cast<uint32_t>(l.orders.size()),
+                    static_cast<uint32_t>(f->trades.size()),
+                    static_cast<uint32_t>(NumTrades(l))});
+                for (const auto &o : l.orders) {
+                    f->orders.push_back(FrozenOrder{o.orderId, o.size});
+                    f->order_ids.push_back(o.orderId);
+                }
+                if constexpr (Policy::kTradeInference)
+                    f->trades.insert(f->trades.end(),
+                                     l.unconfirmed_trades.begin(),
+                                     l.unconfirmed_trades.end());
+                return true;
+            });
+        }
+
+        std::sort(f->order_ids.begin(), f->order_ids.end());
+
+        bids.clear();
+        asks.clear();
+        // clear() keeps the buckets and capacities, replace them instead
+        orderMap = decltype(orderMap)();
+        this->free_levels = decltype(this->free_levels)();
+        touched = decltype(touched)();
+        if constexpr (Policy::kL2Reconcile) {
+            bid_diff = L2SideDiff();
+            ask_diff = L2SideDiff();
+        }
+        frozen = std::move(f);
+        return before - MemoryUsage();
+    }
+
+    // rebuilds the live book from the frozen form
+    void Thaw() {
+        if (!frozen)
+            return;
+        auto f = std::move(frozen);
+        orderMap.reserve(f->orders.size());
+        for (size_t i = 0; i < f->levels.size(); i++) {
+            const auto &fl = f->levels[i];
+            bool is_bid = i < f->num_bids;
+            auto &level = GetOrAddLevel(is_bid, fl.price);
+            FillLevel(*f, fl, is_bid, level);
+            for (auto it = level.orders.begin(); it != level.orders.end(); ++it)
+                orderMap[it->orderId] = it;
+        }
+    }
+
+    bool Hibernated() const { return frozen != nullptr; }
+
+    // the frozen form while hibernated, else nullptr
+    const FrozenBook *Frozen() const { return frozen.get(); }
+
+    // calls f(const Order &) for each estimated order of a frozen level
+    template <typename Func>
+    void ForEachFrozenOrder(const FrozenLevel &level, bool is_bid,
+                            Func &&f) const {
+        const auto *first = frozen->Orders(level);
+        const auto *last = first + level.num_orders;
+        if constexpr (Policy::kEstimatedOrders) {
+            OrderEstimate{is_bid, level.price, level.qty, level.l2_qty,
+                          level.unconfirmed_trade_qty}
+                .ForEach(first, last, f);
+        } else {
+            for (; first != last; ++first)
+                f(Order{first->orderId, is_bid, first->size, level.price});
+        }
+    }
+
+    int FrozenEstimatedQty(const FrozenLevel &level) const {
+        if constexpr (Policy::kEstimatedOrders)
+            return std::max(0, level.l2_qty - level.unconfirmed_trade_qty);
+        else
+            return level.qty;
+    }
+
+    // approximate heap bytes of the book: level map nodes (recycled ones
+    // included), order list nodes, orderMap, trade deques, the frozen form
+    size_t MemoryUsage() const {
+        // red-black tree node: color, parent, left, right, then the value
+        constexpr size_t kLevelNode =
+            4 * sizeof(void *) + sizeof(std::pair<const double, Level>);
+        constexpr size_t kOrderNode = 2 * sizeof(void *) + sizeof(Order);
+        constexpr size_t kOrderMapNode =
+            sizeof(void *) +
+            sizeof(std::pair<const int, std::list<Order>::iterator>);
+        // map of the deque and its first chunk
+        constexpr size_t kTradeDeque = 8 * sizeof(void *) + 512;
+
+        size_t levels = bids.size() + asks.size();
+        size_t bytes = (levels + this->free_levels.size()) * kLevelNode +
+                       orderMap.bucket_count() * sizeof(void *) +
+                       orderMap.size() * kOrderMapNode +
+                       touched.capacity() * sizeof(LevelRef);
+        auto level_bytes = [&](const Level &l) {
+            bytes += l.orders.size() * kOrderNode;
+            if constexpr (Policy::kTradeInference)
+                bytes +=
+                    kTradeDeque + l.unconfirmed_trades.size() * sizeof(Trade);
+        };
+        for (const auto &[price, level] : bids)
+            level_bytes(level);
+        for (const auto &[price, level] : asks)
+            level_bytes(level);
+        if constexpr (Policy::kTradeInference)
+            bytes += this->free_levels.size() * kTradeDeque;
+        if (frozen)
+            bytes += frozen->Bytes();
+        return bytes;
+    }
+
+    void DebugCheck() const {
+        if (frozen)
+            return;
+        for (bool is_bid : {true, false}) {
+            ForEachLevel(is_bid, [](const Level &level) {
+                level.DebugCheck();
+                return true;
+            });
         }
         assert(!bids.empty() || !asks.empty() ||
                bids.begin()->first < asks.begin()->first);
     }
 
   private:
-    SmartObCallback *callback;
+    template <typename Book> friend struct InvariantCheckerT;
+
+    using Impl = L3BookImpl<Level>;
+    using Impl::asks;
+    using Impl::bids;
+    using Impl::EraseLevel;
+    using Impl::GetOrAddLevel;
+    using Impl::orderMap;
+    using Impl::RemoveLevel;
+
+    void BeginUpdate(int seq_id) {
+        cur_seq_id = seq_id;
+        touched.clear();
+    }
+
+    void Touch(const Level &level) {
+        if (!observers.empty())
+            touched.push_back(LevelRef{level.is_bid, level.price});
+    }
+
+    void NotifyObservers() {
+        // an update can touch a level several times, e.g. a trade then its
+        // reconciliation
+        if (touched.size() > 1) {
+            auto key = [](const LevelRef &r) {
+                return std::make_pair(r.is_bid, r.price);
+            };
+            std::sort(touched.begin(), touched.end(),
+                      [&](const LevelRef &a, const LevelRef &b) {
+                          return key(a) < key(b);
+                      });
+            touched.erase(std::unique(touched.begin(), touched.end(),
+                                      [&](const LevelRef &a,
+                                          const LevelRef &b) {
+                                          return key(a) == key(b);
+                                      }),
+                          touched.end());
+        }
+        for (auto *o : observers)
+            o->onUpdate(*this);
+    }
+
+    // the full state of a frozen level, in place of whatever level held
+    static void FillLevel(const FrozenBook &f, const FrozenLevel &fl,
+                          bool is_bid, Level &level) {
+        level.Reset();
+        level.is_bid = is_bid;
+        level.price = fl.price;
+        const auto *orders = f.Orders(fl);
+        for (uint32_t o = 0; o < fl.num_orders; o++)
+            level.orders.push_back(
+                Order{orders[o].orderId, is_bid, orders[o].size, fl.price});
+        level.qty = fl.qty;
+        level.numOrders = fl.num_orders;
+        if constexpr (Policy::kL2Reconcile)
+            level.l2_qty = fl.l2_qty;
+        if constexpr (Policy::kTradeInference) {
+            level.total_unconfirmed_trade_qty = fl.unconfirmed_trade_qty;
+            const auto *trades = f.Trades(fl);
+            level.unconfirmed_trades.assign(trades, trades + fl.num_trades);
+        }
+    }
+
+    static size_t NumTrades(const Level &level) {
+        if constexpr (Policy::kTradeInference)
+            return level.unconfirmed_trades.size();
+        else
+            return 0;
+    }
+
+    void RenderFrozen(std::string &out) const {
+        for (bool is_bid : {true, false}) {
+            out += is_bid ? "BID:\n" : "ASK:\n";
+            frozen->ForEachLevel(is_bid, [&](const FrozenLevel &level) {
+                if (FrozenEstimatedQty(level)) {
+                    AppendLevel(out, level.price, [&](auto &&f) {
+                        ForEachFrozenOrder(level, is_bid, f);
+                    });
+                    out += '\n';
+                }
+                return true;
+            });
+        }
+    }
+
+    Callback *callback;
+    std::vector<Observer *> observers;
+    std::vector<LevelRef> touched;
+
+    [[no_unique_address]] FeatureField<Policy::kL2Reconcile,
+                                       const SoaKernels *, 0> kernels{};
+    [[no_unique_address]] FeatureField<Policy::kL2Reconcile, L2SideDiff, 1>
+        bid_diff{};
+    [[no_unique_address]] FeatureField<Policy::kL2Reconcile, L2SideDiff, 2>
+        ask_diff{};
+
+    std::unique_ptr<FrozenBook> frozen;
+
+    // L2 or trades can overtake an L3 update
+    static constexpr bool kCrossStream =
+        Policy::kL2Reconcile || Policy::kTradeInference;
 
+    int cur_seq_id = 0;
     int last_l3_seq_id = 0;
-    int last_l2_seq_id = 0;
-    double last_l2_best_bid = 0.0,
-           last_l2_best_ask = std::numeric_limits<double>::max();
-    int last_trade_bid_id = 0, last_trade_ask_id = 0;
+    // the newest L2 or L3 update
+    [[no_unique_address]] FeatureField<kCrossStream, int, 3> last_l2_seq_id{};
+    [[no_unique_address]] FeatureField<kCrossStream, double, 4>
+        last_l2_best_bid{};
+    // set to the max price by the constructor
+    [[no_unique_address]] FeatureField<kCrossStream, double, 5>
+        last_l2_best_ask{};
+    [[no_unique_address]] FeatureField<Policy::kTradeInference, int, 6>
+        last_trade_bid_id{};
+    [[no_unique_address]] FeatureField<Policy::kTradeInference, int, 7>
+        last_trade_ask_id{};
 };
 
 // level : orders + guessed order - traded orders
\ No newline at end of file
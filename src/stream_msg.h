@@ -24,7 +24,8 @@ struct Cancel {
 };
 
 // size=0 means cancel
-// Modify = Cancel + Add
+// Modify = Cancel + Add, queue priority depends on the venue, see
+// ModifyPriority
 struct Modify {
     int order_id; // Order ID
     bool is_buy;
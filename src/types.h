@@ -23,4 +23,17 @@ struct L3PriceLevel {
     int numOrders;
     // orders at the back of the list are the most recent
     std::list<Order> orders;
+
+    // empties a removed level before it is reused for another price
+    void Reset() {
+        qty = 0;
+        numOrders = 0;
+        orders.clear();
+    }
+};
+
+// identifies one price level of a book
+struct LevelRef {
+    bool is_bid;
+    double price;
 };
@@ -1,6 +1,21 @@
+#include <fstream>
 #include <gtest/gtest.h>
+#include <random>
+#include <set>
 
+#include "batch_runner.h"
+#include "book_fuzz.h"
+#include "book_history.h"
+#include "consolidated_book.h"
+#include "depth_codec.h"
+#include "feed_handler.h"
+#include "hibernation.h"
+#include "invariants.h"
+#include "journal.h"
+#include "level_soa.h"
 #include "ob.h"
+#include "perf_counters.h"
+#include "reader.h"
 #include "smart_ob.h"
 #include "stream_msg.h"
 #include "types.h"
@@ -263,4 +278,1315 @@ ASK:
 105.000000:[10@1007]
 106.000000:[10@1008]
 )");
-}
\ No newline at end of file
+}
+TEST(Journal, PublishPoll) {
+    auto journal = std::make_unique<EventJournal<8>>();
+    JournalReader reader(*journal);
+    for (int i = 1; i <= 5; i++)
+        journal->Publish(JournalEvent{i, EventType::Add, {i, true, 1, 1.0}});
+
+    std::vector<int> seen;
+    auto n = reader.Poll(
+        [&](const JournalEvent &e) { seen.push_back(e.seq_id); });
+    EXPECT_EQ(n, 5);
+    EXPECT_EQ(seen, std::vector<int>({1, 2, 3, 4, 5}));
+    EXPECT_EQ(reader.Poll([](const JournalEvent &) {}), 0);
+    EXPECT_EQ(reader.overruns, 0);
+}
+
+TEST(Journal, Overrun) {
+    auto journal = std::make_unique<EventJournal<8>>();
+    JournalReader reader(*journal);
+    for (int i = 1; i <= 20; i++)
+        journal->Publish(JournalEvent{i, EventType::Add, {i, true, 1, 1.0}});
+
+    std::vector<int> seen;
+    reader.Poll([&](const JournalEvent &e) { seen.push_back(e.seq_id); });
+    EXPECT_EQ(reader.overruns, 1);
+    EXPECT_EQ(reader.overrun_events, 13);
+    EXPECT_EQ(seen, std::vector<int>({14, 15, 16, 17, 18, 19, 20}));
+}
+
+TEST(Journal, BookCallback) {
+    auto journal = std::make_unique<EventJournal<64>>();
+    JournalCallback cb(*journal);
+    SmartL3Book ob(&cb);
+    JournalReader reader(*journal);
+
+    Mock m;
+    SmartL3Book ref(&m);
+    setup(m, ref);
+    setup(m, ob);
+
+    std::vector<JournalEvent> events;
+    reader.Poll([&](const JournalEvent &e) { events.push_back(e); });
+    ASSERT_EQ(events.size(), 11);
+    EXPECT_EQ(events.front().seq_id, 1);
+    EXPECT_EQ(events.front().type, EventType::Add);
+    EXPECT_EQ(events.back().seq_id, 13);
+    EXPECT_EQ(events.back().type, EventType::Execution);
+    EXPECT_EQ(events.back().info.size, 3);
+}
+
+TEST(Journal, ThreadedConsumerAndWriter) {
+    auto journal = std::make_unique<EventJournal<1 << 12>>();
+    auto path = testing::TempDir() + "journal.bin";
+    std::vector<JournalEvent> written;
+    {
+        AsyncJournalWriter<1 << 12> writer(*journal, path);
+        std::atomic<bool> stop{false};
+        uint64_t consumed = 0;
+        std::thread consumer([&] {
+            JournalReader<EventJournal<1 << 12>, BusySpinWait> reader(
+                *journal, false);
+            reader.Run(stop, [&](const JournalEvent &) { consumed++; });
+        });
+        for (int i = 1; i <= 1000; i++) {
+            journal->Publish(JournalEvent{i, EventType::Execution,
+                                          {i, i % 2 == 0, i, 100.5}});
+        }
+        stop = true;
+        consumer.join();
+        writer.Stop();
+        EXPECT_EQ(consumed, 1000);
+        EXPECT_EQ(writer.Written(), 1000);
+        EXPECT_EQ(writer.LostEvents(), 0);
+    }
+    auto events = AsyncJournalWriter<1 << 12>::Load(path);
+    ASSERT_EQ(events.size(), 1000);
+    EXPECT_EQ(events[41].seq_id, 42);
+    EXPECT_EQ(events[41].info.is_buy, true);
+    EXPECT_EQ(events[41].info.price, 100.5);
+}
+
+TEST(Reader, ParseCapture) {
+    std::istringstream in(R"(# comment
+L3,1,ADD,1001,B,10,100.0
+
+L3,2,MODIFY,1001,B,5,99.5
+L3,3,CANCEL,1001,B
+L3,4,EXEC,1002,S,3
+L2,5,100.0:7;99.1:5,
+TRADE,6,S,103.0,2
+)");
+    std::vector<StreamMsg> msgs;
+    StreamMsg msg;
+    while (ReadMessage(in, msg))
+        msgs.push_back(msg);
+    ASSERT_EQ(msgs.size(), 6);
+
+    auto &add = std::get<level3::Add>(std::get<Level3>(msgs[0]).msg);
+    EXPECT_EQ(add.order_id, 1001);
+    EXPECT_TRUE(add.is_buy);
+    EXPECT_EQ(add.price, 100.0);
+    auto &exec = std::get<level3::Execute>(std::get<Level3>(msgs[3]).msg);
+    EXPECT_FALSE(exec.is_buy);
+    EXPECT_EQ(exec.size, 3);
+    auto &snapshot = std::get<Snapshot>(msgs[4]);
+    EXPECT_EQ(snapshot.seq_id, 5);
+    EXPECT_EQ(snapshot.bids.size(), 2);
+    EXPECT_EQ(snapshot.asks.size(), 0);
+    EXPECT_EQ(std::get<Trade>(msgs[5]).price, 103.0);
+}
+
+TEST(Profiler, CountsPerMsgKind) {
+    Mock m;
+    SmartL3Book ob(&m);
+    BookProfiler profiler;
+    profiler.UpdateL3(ob, Level3{1, level3::Add{1001, true, 10, 100.0}});
+    profiler.UpdateL3(ob, Level3{2, level3::Add{1002, true, 10, 101.0}});
+    profiler.UpdateL3(ob, Level3{3, level3::Cancel{1002, true}});
+    profiler.UpdateTrade(ob, Trade{4, true, 100.0, 3});
+
+    EXPECT_EQ(profiler.Stats(L3Add).count, 2);
+    EXPECT_EQ(profiler.Stats(L3Cancel).count, 1);
+    EXPECT_EQ(profiler.Stats(TradeMsg).count, 1);
+    EXPECT_EQ(profiler.Stats(L2Snapshot).count, 0);
+
+    // the report must work with or without counters, e.g. in a container
+    std::ostringstream report;
+    profiler.Report(report);
+    EXPECT_NE(report.str().find("l3_add"), std::string::npos);
+    EXPECT_EQ(report.str().find("l2 "), std::string::npos);
+}
+
+TEST(Profiler, ScalesMultiplexedCounts) {
+    PerfSample before, after;
+    before.values[Cycles] = 100;
+    after.values[Cycles] = 300;
+    PerfValues delta{};
+
+    // never scheduled in between, no measurement at all
+    after.time_enabled = 1000;
+    EXPECT_FALSE(PerfDelta(before, after, delta));
+
+    // ran the whole time
+    after.time_running = 1000;
+    ASSERT_TRUE(PerfDelta(before, after, delta));
+    EXPECT_EQ(delta[Cycles], 200);
+
+    // ran a quarter of the time
+    after.time_running = 250;
+    ASSERT_TRUE(PerfDelta(before, after, delta));
+    EXPECT_EQ(delta[Cycles], 800);
+}
+
+TEST(LevelSoA, KernelsMatchScalar) {
+    if (!Avx2Supported())
+        GTEST_SKIP() << "no avx2 on this cpu";
+    const auto &s = ScalarKernels();
+    const auto &v = Avx2Kernels();
+
+    std::vector<int64_t> book, snap;
+    std::vector<int32_t> a, b;
+    for (int i = 0; i < 53; i++) {
+        book.push_back(ToTicks(100.0 - i * 0.1));
+        if (i % 3)
+            snap.push_back(ToTicks(100.0 - i * 0.1));
+        a.push_back(i * 7 % 13);
+        b.push_back(i * 5 % 11);
+    }
+    snap.push_back(ToTicks(42.0));
+
+    std::vector<int32_t> idx_s(book.size()), idx_v(book.size());
+    s.match_levels(book.data(), book.size(), snap.data(), snap.size(), true,
+                   idx_s.data());
+    v.match_levels(book.data(), book.size(), snap.data(), snap.size(), true,
+                   idx_v.data());
+    EXPECT_EQ(idx_s, idx_v);
+    EXPECT_EQ(idx_s[0], -1);
+    EXPECT_EQ(idx_s[1], 0);
+    EXPECT_EQ(idx_s[52], 34);
+
+    // the same levels as asks, ascending from the touch
+    std::reverse(book.begin(), book.end());
+    snap.pop_back();
+    std::reverse(snap.begin(), snap.end());
+    snap.insert(snap.begin(), ToTicks(42.0));
+    s.match_levels(book.data(), book.size(), snap.data(), snap.size(), false,
+                   idx_s.data());
+    v.match_levels(book.data(), book.size(), snap.data(), snap.size(), false,
+                   idx_v.data());
+    EXPECT_EQ(idx_s, idx_v);
+    EXPECT_EQ(idx_s[0], 1);
+    EXPECT_EQ(idx_s[52], -1);
+
+    std::vector<int32_t> d_s(a.size()), d_v(a.size());
+    s.qty_deltas(a.data(), b.data(), a.size(), d_s.data());
+    v.qty_deltas(a.data(), b.data(), a.size(), d_v.data());
+    EXPECT_EQ(d_s, d_v);
+}
+
+TEST(LevelSoA, SideDiff) {
+    LevelSoA book, snapshot;
+    book.Push(102.0, 7);
+    book.Push(100.0, 10);
+    book.Push(99.1, 5);
+    snapshot.Push(100.0, 7);
+    snapshot.Push(99.1, 5);
+    snapshot.Push(98.0, 4);
+
+    SideDiff diff;
+    diff.Compute(GetSoaKernels(), book, snapshot, true);
+    EXPECT_EQ(diff.book_to_snap, std::vector<int32_t>({-1, 0, 1}));
+    EXPECT_EQ(diff.snap_to_book, std::vector<int32_t>({1, 2, -1}));
+    EXPECT_EQ(diff.l2_deltas, std::vector<int32_t>({-7, -3, 0}));
+}
+
+TEST(LevelSoA, ScalarBookL2LeadsL3) {
+    Mock m;
+    SmartL3Book ob(&m);
+    ob.SetSoaKernels(ScalarKernels());
+    setup(m, ob);
+    ob.UpdateL2(Snapshot{
+        20,
+        {{100.0, 10}, {99.1, 5}},                            // Bids
+        {{103.0, 10}, {104.0, 10}, {105.0, 10}, {106.0, 10}} // Asks
+    });
+    EXPECT_EQ(m.infos.size(), 13);
+    EXPECT_EQ(m.ob, R"(BID:
+100.000000:[10@1001]
+99.100000:[5@1003]
+ASK:
+103.000000:[10@1005]
+104.000000:[10@1006]
+105.000000:[10@1007]
+106.000000:[10@1008]
+)");
+}
+
+TEST(LevelSoA, LevelsBehindSnapshotAreRemoved) {
+    Mock m;
+    SmartL3Book ob(&m);
+    setup(m, ob);
+    // the snapshot ends before the deeper levels of both sides
+    ob.UpdateL2(Snapshot{20, {{102.0, 7}}, {{103.0, 10}}});
+    EXPECT_EQ(m.ob, R"(BID:
+102.000000:[7@1004]
+ASK:
+103.000000:[10@1005]
+)");
+    EXPECT_EQ(ob.FindLevel(true, 99.1)->l2_qty, 0);
+    EXPECT_EQ(ob.FindLevel(false, 106.0)->l2_qty, 0);
+}
+
+// poll the handler until `packets` arrived or a second passed
+template <typename Handler> void PollFor(Handler &handler, uint64_t packets) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (handler.stats.packets < packets &&
+           std::chrono::steady_clock::now() < deadline)
+        handler.Poll();
+}
+
+TEST(FeedHandler, LoopbackReplay) {
+    Mock m;
+    SmartL3Book ob(&m);
+    UdpFeedHandler handler(ob);
+    ASSERT_TRUE(handler.Good()) << handler.Error();
+
+    LoopbackPublisher publisher(handler.Ports());
+    std::istringstream capture(R"(L3,1,ADD,1001,B,10,100.0
+L3,2,ADD,1002,B,10,101.0
+L3,3,ADD,1003,B,10,99.0
+L3,4,ADD,1004,B,10,102.0
+L3,5,ADD,1005,S,10,103.0
+L3,6,ADD,1006,S,10,104.0
+L3,7,ADD,1007,S,10,105.0
+L3,8,ADD,1008,S,10,106.0
+L3,9,CANCEL,1002,B
+L3,10,MODIFY,1003,B,5,99.1
+L3,13,EXEC,1004,B,3
+)");
+    EXPECT_EQ(publisher.Replay(capture), 11);
+    PollFor(handler, 11);
+
+    EXPECT_EQ(handler.stats.packets, 11);
+    EXPECT_EQ(handler.stats.drops[L3Stream], 0);
+    EXPECT_EQ(handler.stats.malformed, 0);
+    EXPECT_GE(handler.stats.max_batch, 1);
+    EXPECT_EQ(handler.stats.recv_to_callback.count, 11);
+    EXPECT_EQ(m.infos.size(), 11);
+    EXPECT_EQ(m.ob, ob_str);
+}
+
+TEST(FeedHandler, SnapshotTradeAndDrops) {
+    Mock m;
+    SmartL3Book ob(&m);
+    UdpFeedHandler handler(ob);
+    ASSERT_TRUE(handler.Good()) << handler.Error();
+    LoopbackPublisher publisher(handler.Ports());
+
+    publisher.Send(Snapshot{1, {{100.0, 7}, {99.1, 5}}, {{103.0, 10}}});
+    PollFor(handler, 1);
+    publisher.SkipPacket(TradeStream);
+    publisher.SkipPacket(TradeStream);
+    publisher.Send(Trade{2, true, 100.0, 3});
+    PollFor(handler, 2);
+
+    EXPECT_EQ(handler.stats.drops[TradeStream], 2);
+    EXPECT_EQ(handler.stats.drops[L2Stream], 0);
+    EXPECT_EQ(ob.ToString(), R"(BID:
+100.000000:[4@0]
+99.100000:[5@0]
+ASK:
+103.000000:[10@0]
+)");
+}
+
+TEST(FeedHandler, UnknownL3TypeIsMalformed) {
+    Mock m;
+    SmartL3Book ob(&m);
+    UdpFeedHandler handler(ob);
+    ASSERT_TRUE(handler.Good()) << handler.Error();
+    LoopbackPublisher publisher(handler.Ports());
+
+    publisher.Send(Level3{1, level3::Add{1001, true, 10, 100.0}});
+    PollFor(handler, 1);
+
+    // a cancel of the order with its type byte corrupted
+    char buf[kMaxDatagram];
+    auto len = EncodeMessage(Level3{2, level3::Cancel{1001, true}},
+                             publisher.NextPacketSeq(L3Stream), 0, buf);
+    buf[1] = 9;
+    ASSERT_TRUE(publisher.SendRaw(L3Stream, buf, len));
+    PollFor(handler, 2);
+
+    EXPECT_EQ(handler.stats.malformed, 1);
+    EXPECT_EQ(handler.stats.drops[L3Stream], 0);
+    EXPECT_EQ(m.infos.size(), 1);
+    EXPECT_EQ(ob.ToString(), R"(BID:
+100.000000:[10@1001]
+ASK:
+)");
+}
+
+TEST(Invariants, CleanScenarios) {
+    Mock m;
+    SmartL3Book ob(&m);
+    InvariantChecker checker(1);
+    std::vector<InvariantViolation> violations;
+    checker.on_violation = [&](const InvariantViolation &v) {
+        violations.push_back(v);
+    };
+    ob.AddObserver(&checker);
+
+    setup(m, ob);
+    ob.UpdateL2(Snapshot{
+        20,
+        {{100.0, 7}, {99.1, 5}},                             // Bids
+        {{103.0, 10}, {104.0, 10}, {105.0, 10}, {106.0, 10}} // Asks
+    });
+    ob.UpdateTrade(Trade{21, true, 100.0, 3});
+    ob.UpdateL3(Level3{22, level3::Add{1100, true, 3, 99.1}});
+
+    EXPECT_EQ(checker.updates, 14);
+    EXPECT_EQ(checker.sweeps, 14);
+    EXPECT_EQ(checker.Total(), 0);
+    EXPECT_TRUE(violations.empty());
+    EXPECT_EQ(ob.TouchedLevels().size(), 1);
+}
+
+TEST(Invariants, TradeThroughDropsOrders) {
+    Mock m;
+    SmartL3Book ob(&m);
+    InvariantChecker checker(1);
+    ob.AddObserver(&checker);
+    setup(m, ob);
+
+    // the trade removes the 102 level, its order must leave orderMap too
+    ob.UpdateTrade(Trade{18, true, 100.0, 3});
+    EXPECT_EQ(checker.Count(InvariantKind::OrderMapOrphan), 0);
+    ob.UpdateL3(Level3{19, level3::Execute{1004, true, 7}});
+    EXPECT_EQ(checker.Total(), 0);
+}
+
+TEST(Invariants, CrossedBook) {
+    Mock m;
+    SmartL3Book ob(&m);
+    InvariantChecker checker;
+    std::vector<InvariantViolation> violations;
+    checker.on_violation = [&](const InvariantViolation &v) {
+        violations.push_back(v);
+    };
+    ob.AddObserver(&checker);
+
+    ob.UpdateL3(Level3{1, level3::Add{1001, false, 10, 100.0}});
+    ob.UpdateL3(Level3{2, level3::Add{1002, true, 10, 100.5}});
+
+    ASSERT_EQ(violations.size(), 1);
+    EXPECT_EQ(violations[0].kind, InvariantKind::CrossedBook);
+    EXPECT_EQ(violations[0].seq_id, 2);
+    EXPECT_EQ(violations[0].price, 100.5);
+    EXPECT_EQ(checker.sweeps, 0);
+}
+
+TEST(Invariants, TouchedLevelsAreUnique) {
+    struct Recorder : SmartObObserver {
+        void onUpdate(const SmartL3Book &book) override {
+            std::set<std::pair<bool, double>> seen;
+            for (const auto &ref : book.TouchedLevels())
+                duplicates += !seen.emplace(ref.is_bid, ref.price).second;
+            total += seen.size();
+        }
+        size_t duplicates = 0;
+        size_t total = 0;
+    };
+    Mock m;
+    SmartL3Book ob(&m);
+    Recorder recorder;
+    ob.AddObserver(&recorder);
+
+    setup(m, ob);
+    ob.UpdateL2(Snapshot{
+        20,
+        {{100.0, 7}, {99.1, 5}},                             // Bids
+        {{103.0, 10}, {104.0, 10}, {105.0, 10}, {106.0, 10}} // Asks
+    });
+    ob.UpdateTrade(Trade{21, true, 100.0, 3});
+    // reconciles its level, then cancels the bids behind the trade
+    ob.UpdateL3(Level3{21, level3::Add{1100, true, 3, 100.0}});
+
+    EXPECT_GT(recorder.total, 0);
+    EXPECT_EQ(recorder.duplicates, 0);
+}
+
+// GetOrders as it was before ForEachOrder, builds then trims from the back
+std::vector<Order> ReferenceGetOrders(const L3SmartPriceLevel &level) {
+    std::vector<Order> orders;
+    int should_cancel_qty = std::max(0, level.qty - level.l2_qty);
+    for (const auto &order : level.orders) {
+        if (order.size > should_cancel_qty) {
+            auto order_cpy = order;
+            order_cpy.size -= should_cancel_qty;
+            orders.push_back(order_cpy);
+            should_cancel_qty = 0;
+        } else {
+            should_cancel_qty -= order.size;
+        }
+    }
+    if (level.l2_qty > level.qty)
+        orders.push_back(
+            Order{0, level.is_bid, level.l2_qty - level.qty, level.price});
+    auto trade_remaining_qty = level.total_unconfirmed_trade_qty;
+    while (!orders.empty() && trade_remaining_qty > 0) {
+        if (orders.back().size <= trade_remaining_qty) {
+            trade_remaining_qty -= orders.back().size;
+            orders.pop_back();
+        } else {
+            orders.back().size -= trade_remaining_qty;
+            break;
+        }
+    }
+    return orders;
+}
+
+TEST(Render, ForEachOrderMatchesReference) {
+    std::mt19937 rng(7);
+    for (int iter = 0; iter < 2000; iter++) {
+        L3SmartPriceLevel level;
+        level.is_bid = true;
+        level.price = 100.0;
+        level.qty = 0;
+        int n = rng() % 5;
+        for (int i = 0; i < n; i++) {
+            int size = 1 + rng() % 10;
+            level.orders.push_back(Order{i + 1, true, size, 100.0});
+            level.qty += size;
+        }
+        level.l2_qty = rng() % 40;
+        level.total_unconfirmed_trade_qty = rng() % 20;
+
+        auto expected = ReferenceGetOrders(level);
+        auto actual = level.GetOrders();
+        ASSERT_EQ(actual.size(), expected.size());
+        for (size_t i = 0; i < actual.size(); i++) {
+            EXPECT_EQ(actual[i].orderId, expected[i].orderId);
+            EXPECT_EQ(actual[i].size, expected[i].size);
+        }
+    }
+}
+
+TEST(Render, ReusedBuffer) {
+    Mock m;
+    SmartL3Book ob(&m);
+    setup(m, ob);
+    std::string out = "stale";
+    ob.Render(out);
+    EXPECT_EQ(out, ob_str);
+    auto capacity = out.capacity();
+    ob.Render(out);
+    EXPECT_EQ(out, ob_str);
+    EXPECT_EQ(out.capacity(), capacity);
+}
+
+TEST(DepthCodec, RoundTripAndDelta) {
+    Mock m;
+    SmartL3Book ob(&m);
+    setup(m, ob);
+
+    DepthEncoder encoder(3);
+    DepthDecoder decoder;
+    std::vector<uint8_t> buf;
+
+    encoder.Encode(ob, buf);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+    const auto &bids = decoder.State().sides[0];
+    const auto &asks = decoder.State().sides[1];
+    ASSERT_EQ(bids.size(), 3);
+    ASSERT_EQ(asks.size(), 3);
+    EXPECT_EQ(bids[0].ticks, ToTicks(102.0));
+    EXPECT_EQ(bids[0].qty, 7);
+    EXPECT_EQ(bids[2].ticks, ToTicks(99.1));
+    EXPECT_EQ(asks[2].ticks, ToTicks(105.0));
+    EXPECT_EQ(decoder.State().seq_id, 13);
+    auto keyframe_size = buf.size();
+
+    // one more order at 100, only that level changes
+    ob.UpdateL3(Level3{14, level3::Add{1100, true, 3, 100.0}});
+    encoder.Encode(ob, buf);
+    EXPECT_EQ(buf[0], 0);
+    EXPECT_LT(buf.size(), keyframe_size / 2);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+    EXPECT_EQ(bids[1].qty, 13);
+    EXPECT_EQ(bids[1].num_orders, 2);
+    EXPECT_EQ(decoder.State().seq_id, 14);
+
+    DepthSnapshot expected;
+    CaptureDepth(ob, 3, expected);
+    for (int s = 0; s < 2; s++) {
+        const auto &a = decoder.State().sides[s];
+        ASSERT_EQ(a.size(), expected.sides[s].size());
+        for (size_t i = 0; i < a.size(); i++) {
+            EXPECT_EQ(a[i].ticks, expected.sides[s][i].ticks);
+            EXPECT_EQ(a[i].qty, expected.sides[s][i].qty);
+            EXPECT_EQ(a[i].num_orders, expected.sides[s][i].num_orders);
+        }
+        EXPECT_EQ(decoder.State().orders[s], expected.orders[s]);
+    }
+    // the bids are 102 then 100, whose orders follow
+    const auto &bid_orders = decoder.State().orders[0];
+    ASSERT_EQ(bid_orders.size(), 1u + 2 + 1);
+    EXPECT_EQ(bid_orders[1], (DepthOrder{1001, 10}));
+    EXPECT_EQ(bid_orders[2], (DepthOrder{1100, 3}));
+
+    // a change of one order at the same level qty still reaches the consumer
+    ob.UpdateL3(Level3{15, level3::Cancel{1100, true}});
+    ob.UpdateL3(Level3{16, level3::Add{1101, true, 3, 100.0}});
+    encoder.Encode(ob, buf);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+    EXPECT_EQ(bid_orders[2], (DepthOrder{1101, 3}));
+
+    // a consumer joining mid stream waits for the next keyframe
+    DepthDecoder late;
+    EXPECT_FALSE(late.Decode(buf.data(), buf.size()));
+    encoder.Reset();
+    encoder.Encode(ob, buf);
+    EXPECT_TRUE(late.Decode(buf.data(), buf.size()));
+    EXPECT_EQ(late.State().sides[0].size(), 3);
+}
+
+TEST(DepthCodec, GapWaitsForKeyframe) {
+    Mock m;
+    SmartL3Book ob(&m);
+    setup(m, ob);
+
+    DepthEncoder encoder(3);
+    DepthDecoder decoder;
+    std::vector<uint8_t> buf;
+    encoder.Encode(ob, buf);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+
+    // the delta of seq 14 is lost, the one of seq 15 must not apply
+    ob.UpdateL3(Level3{14, level3::Add{1100, true, 3, 100.0}});
+    encoder.Encode(ob, buf);
+    ob.UpdateL3(Level3{15, level3::Add{1101, true, 2, 100.0}});
+    encoder.Encode(ob, buf);
+    auto delta = buf;
+    EXPECT_FALSE(decoder.Decode(delta.data(), delta.size()));
+    EXPECT_FALSE(decoder.Synced());
+    EXPECT_EQ(decoder.Gaps(), 1);
+    EXPECT_EQ(decoder.State().seq_id, 13);
+
+    // nor may a repeated one
+    encoder.Reset();
+    encoder.Encode(ob, buf);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+    EXPECT_EQ(decoder.State().sides[0][1].qty, 15);
+    ob.UpdateL3(Level3{16, level3::Cancel{1101, true}});
+    encoder.Encode(ob, buf);
+    ASSERT_TRUE(decoder.Decode(buf.data(), buf.size()));
+    EXPECT_FALSE(decoder.Decode(buf.data(), buf.size()));
+    EXPECT_EQ(decoder.Gaps(), 2);
+    EXPECT_EQ(decoder.State().sides[0][1].qty, 13);
+}
+
+struct BboRecorder : ConsolidatedCallback {
+    void onBboChange(const ConsolidatedBook &,
+                     const ConsolidatedBbo &bbo) override {
+        changes.push_back(bbo);
+    }
+    std::vector<ConsolidatedBbo> changes;
+};
+
+TEST(Consolidated, MergesVenues) {
+    SmartObCallback nop;
+    SmartL3Book a(&nop), b(&nop);
+    BboRecorder rec;
+    ConsolidatedBook cb(2, &rec);
+    cb.Attach(0, a);
+    cb.Attach(1, b);
+
+    a.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    a.UpdateL3(Level3{2, level3::Add{2, false, 4, 102.0}});
+    b.UpdateL3(Level3{1, level3::Add{1, true, 5, 100.0}});
+    b.UpdateL3(Level3{2, level3::Add{2, true, 3, 101.0}});
+
+    auto bbo = cb.Bbo();
+    EXPECT_EQ(bbo.bid_price, 101.0);
+    EXPECT_EQ(bbo.bid_qty, 3);
+    EXPECT_EQ(bbo.ask_price, 102.0);
+    EXPECT_EQ(bbo.ask_qty, 4);
+    auto *level = cb.FindLevel(true, 100.0);
+    ASSERT_NE(level, nullptr);
+    EXPECT_EQ(level->qty, 15);
+    EXPECT_EQ(level->venue_qty, std::vector<int>({10, 5}));
+
+    // the l3 cancel carries no price, the touched level is re-read
+    b.UpdateL3(Level3{3, level3::Cancel{2, true}});
+    EXPECT_EQ(cb.Bbo().bid_price, 100.0);
+    EXPECT_EQ(cb.Bbo().bid_qty, 15);
+    EXPECT_EQ(cb.NumLevels(true), 1);
+
+    // an ask at the same price on the other venue does not change the bbo
+    // price, only its qty
+    b.UpdateL3(Level3{4, level3::Add{3, false, 6, 102.0}});
+    EXPECT_EQ(cb.Bbo().ask_qty, 10);
+
+    std::vector<double> prices;
+    cb.ForEachLevel(false, 5, [&](double price, const ConsolidatedLevel &l) {
+        prices.push_back(price);
+        EXPECT_EQ(l.venue_qty, std::vector<int>({4, 6}));
+    });
+    EXPECT_EQ(prices, std::vector<double>({102.0}));
+    EXPECT_EQ(rec.changes.size(), 6);
+}
+
+TEST(Consolidated, AttachSeedsPopulatedVenue) {
+    SmartObCallback nop;
+    SmartL3Book a(&nop), b(&nop);
+    a.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    b.UpdateL3(Level3{1, level3::Add{1, true, 5, 100.0}});
+    b.UpdateL3(Level3{2, level3::Add{2, false, 4, 102.0}});
+
+    BboRecorder rec;
+    ConsolidatedBook cb(2, &rec);
+    EXPECT_FALSE(cb.Attach(2, a));
+    ASSERT_TRUE(cb.Attach(0, a));
+    ASSERT_TRUE(cb.Attach(1, b));
+    EXPECT_EQ(rec.changes.size(), 2u);
+    EXPECT_EQ(cb.Bbo().bid_price, 100.0);
+    EXPECT_EQ(cb.Bbo().bid_qty, 15);
+    EXPECT_EQ(cb.Bbo().ask_price, 102.0);
+    EXPECT_EQ(cb.FindLevel(true, 100.0)->venue_qty, std::vector<int>({10, 5}));
+
+    // later updates build on the seeded levels
+    b.UpdateL3(Level3{3, level3::Cancel{1, true}});
+    EXPECT_EQ(cb.Bbo().bid_qty, 10);
+    EXPECT_EQ(cb.FindLevel(true, 100.0)->venue_qty, std::vector<int>({10, 0}));
+}
+
+TEST(Consolidated, TradeThroughRemovesVenueLevels) {
+    Mock m;
+    SmartL3Book a(&m);
+    ConsolidatedBook cb(1);
+    cb.Attach(0, a);
+    setup(m, a);
+    EXPECT_EQ(cb.Bbo().bid_price, 102.0);
+
+    // the trade at 100 removes the 102 level
+    a.UpdateTrade(Trade{18, true, 100.0, 3});
+    EXPECT_EQ(cb.Bbo().bid_price, 100.0);
+    EXPECT_EQ(cb.Bbo().bid_qty, 7);
+    EXPECT_EQ(cb.FindLevel(true, 102.0), nullptr);
+}
+
+// drives the book and records ToString after the last update of each version
+struct HistoryScenario {
+    Mock m;
+    SmartL3Book ob{&m};
+    std::map<int, std::string> expected;
+    int version = 0;
+
+    void Record() {
+        version = std::max(version, ob.CurrentSeqId());
+        expected[version] = ob.ToString();
+    }
+
+    void Run() {
+        for (int i = 1; i <= 40; i++) {
+            ob.UpdateL3(Level3{i, level3::Add{i, i % 2 == 0, i % 7 + 1,
+                                              i % 2 == 0 ? 100.0 - i % 5
+                                                         : 101.0 + i % 5}});
+            Record();
+        }
+        ob.UpdateL3(Level3{41, level3::Cancel{10, true}});
+        Record();
+        ob.UpdateL3(Level3{42, level3::Modify{12, true, 2, 97.5}});
+        Record();
+        ob.UpdateL2(Snapshot{50, {{100.0, 3}, {99.0, 20}}, {{101.0, 4}}});
+        Record();
+        ob.UpdateTrade(Trade{51, true, 99.0, 5});
+        Record();
+        ob.UpdateL3(Level3{43, level3::Add{100, true, 5, 99.0}});
+        Record();
+    }
+};
+
+TEST(History, AsOfMatchesReplay) {
+    HistoryScenario s;
+    BookHistory history(8);
+    history.Attach(s.ob);
+    s.Run();
+
+    EXPECT_GT(history.NumCheckpoints(), 4);
+    HistoricalBook book;
+    for (auto &[version, str] : s.expected) {
+        ASSERT_TRUE(history.AsOf(version, book));
+        EXPECT_EQ(book.ToString(), str) << "as of " << version;
+    }
+    // in between two versions, the older one applies
+    ASSERT_TRUE(history.AsOf(45, book));
+    EXPECT_EQ(book.ToString(), s.expected[42]);
+    ASSERT_TRUE(history.AsOf(0, book));
+    EXPECT_EQ(book.ToString(), "BID:\nASK:\n");
+}
+
+TEST(History, LevelHistory) {
+    HistoryScenario s;
+    BookHistory history(8);
+    history.Attach(s.ob);
+    s.Run();
+
+    std::vector<std::pair<int, int>> changes;
+    history.LevelHistory(true, 99.0, [&](int v, const HistOrder *o, size_t n) {
+        int qty = 0;
+        for (size_t i = 0; i < n; i++)
+            qty += o[i].size;
+        changes.emplace_back(v, qty);
+    });
+    ASSERT_FALSE(changes.empty());
+    EXPECT_EQ(changes.front().first, 6);
+    // the l2 snapshot set 20, the trade executed 5
+    EXPECT_EQ(changes[changes.size() - 2], std::make_pair(51, 15));
+}
+
+TEST(History, MemoryBudget) {
+    HistoryScenario s;
+    BookHistory history(4, 2000);
+    history.Attach(s.ob);
+    s.Run();
+
+    EXPECT_LE(history.MemoryUsage(), 2000);
+    EXPECT_GT(history.OldestVersion(), 0);
+    HistoricalBook book;
+    EXPECT_FALSE(history.AsOf(history.OldestVersion() - 1, book));
+    for (auto it = s.expected.lower_bound(history.OldestVersion());
+         it != s.expected.end(); ++it) {
+        ASSERT_TRUE(history.AsOf(it->first, book));
+        EXPECT_EQ(book.ToString(), it->second) << "as of " << it->first;
+    }
+}
+
+TEST(Batch, ParallelMatchesSerial) {
+    std::vector<std::string> paths;
+    for (int f = 0; f < 6; f++) {
+        auto path =
+            testing::TempDir() + "capture_" + std::to_string(f) + ".csv";
+        std::ofstream out(path);
+        for (int i = 1; i <= 50 * (f + 1); i++) {
+            out << "L3," << 2 * i << ",ADD," << i << ","
+                << (i % 2 ? "B" : "S") << "," << i % 9 + 1 << ","
+                << (i % 2 ? 100.0 - i % 4 : 101.0 + i % 4) << "\n";
+            if (i % 10 == 0)
+                out << "TRADE," << 2 * i + 1 << ",B," << 100.0 - i % 4
+                    << ",2\n";
+        }
+        paths.push_back(path);
+    }
+    std::istringstream manifest("# symbol-days\n" + paths[0] + "\n\n" +
+                                paths[1] + "\n" + paths[2] + "\n" + paths[3] +
+                                "\n" + paths[4] + "\n" + paths[5] + "\n" +
+                                testing::TempDir() + "missing.csv\n");
+    auto listed = ReadManifest(manifest);
+    ASSERT_EQ(listed.size(), 7);
+
+    auto report = RunBatch(listed, 3, false);
+    ASSERT_EQ(report.files.size(), 7);
+    EXPECT_EQ(report.failed, 1);
+    EXPECT_FALSE(report.files[6].error.empty());
+
+    ReplayResult serial;
+    for (size_t i = 0; i < paths.size(); i++) {
+        auto r = ReplayFile(paths[i]);
+        EXPECT_EQ(report.files[i].messages, r.messages);
+        EXPECT_EQ(report.files[i].exec_qty, r.exec_qty);
+        EXPECT_EQ(report.files[i].cancel_qty, r.cancel_qty);
+        serial.Merge(r);
+    }
+    EXPECT_EQ(report.total.messages, serial.messages);
+    EXPECT_EQ(report.total.adds, serial.adds);
+    EXPECT_EQ(report.total.executions, serial.executions);
+    EXPECT_EQ(report.total.latency.count, serial.messages);
+    EXPECT_GT(report.total.exec_qty, 0);
+
+    std::ostringstream printed;
+    report.Print(printed);
+    EXPECT_NE(printed.str().find("failed 1"), std::string::npos);
+}
+
+TEST(Batch, WorkStealing) {
+    WorkStealingPool pool(4);
+    std::atomic<int> done{0};
+    // two slow tasks hold their workers, the others drain their queues
+    for (int i = 0; i < 2; i++)
+        pool.Submit([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            done++;
+        });
+    for (int i = 0; i < 40; i++)
+        pool.Submit([&] { done++; });
+    pool.Run();
+    EXPECT_EQ(done, 42);
+}
+
+TEST(Batch, IdleWorkerSteals) {
+    // queue 0 gets x then y, queue 1 gets z. worker 0 takes y from the back
+    // and holds until x ran, which only worker 1 can do by stealing it
+    WorkStealingPool pool(2);
+    std::atomic<bool> x_done{false};
+    pool.Submit([&] { x_done = true; });
+    pool.Submit([] {});
+    pool.Submit([&] {
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (!x_done && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::yield();
+    });
+    pool.Run();
+    EXPECT_TRUE(x_done);
+    // worker 1 may also steal y when it gets there first
+    EXPECT_GE(pool.Steals(), 1);
+}
+
+TEST(Batch, AllowedCores) {
+    auto cores = AllowedCores();
+    ASSERT_FALSE(cores.empty());
+    EXPECT_LE(cores.size(), std::max(1u, std::thread::hardware_concurrency()));
+}
+
+std::string ModifyScenario(ModifyPriority priority, int size, double price) {
+    Mock m;
+    SmartL3Book ob(&m);
+    ob.SetModifyPriority(priority);
+    InvariantChecker checker;
+    ob.AddObserver(&checker);
+    ob.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    ob.UpdateL3(Level3{2, level3::Add{2, true, 10, 100.0}});
+    ob.UpdateL3(Level3{3, level3::Modify{1, true, size, price}});
+    checker.FullSweep(ob);
+    EXPECT_EQ(checker.Total(), 0u);
+    return ob.ToString();
+}
+
+TEST(Modify, QueuePriority) {
+    auto front = "BID:\n100.000000:[5@1, 10@2]\nASK:\n";
+    auto back = "BID:\n100.000000:[10@2, 5@1]\nASK:\n";
+    EXPECT_EQ(ModifyScenario(ModifyPriority::LoseAlways, 5, 100.0), back);
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepOnDecrease, 5, 100.0), front);
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepAlways, 5, 100.0), front);
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepOnDecrease, 15, 100.0),
+              "BID:\n100.000000:[10@2, 15@1]\nASK:\n");
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepAlways, 15, 100.0),
+              "BID:\n100.000000:[15@1, 10@2]\nASK:\n");
+    // a price change always loses priority
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepAlways, 5, 101.0),
+              "BID:\n101.000000:[5@1]\n100.000000:[10@2]\nASK:\n");
+    // size 0 cancels
+    EXPECT_EQ(ModifyScenario(ModifyPriority::KeepAlways, 0, 100.0),
+              "BID:\n100.000000:[10@2]\nASK:\n");
+}
+
+TEST(Modify, MovedOrderStaysAddressable) {
+    Mock m;
+    SmartL3Book ob(&m);
+    InvariantChecker checker;
+    ob.AddObserver(&checker);
+    setup(m, ob);
+    // 1003 was moved from 99.0 to 99.1, which removed the 99.0 level
+    EXPECT_EQ(ob.FindLevel(true, 99.0), nullptr);
+    ob.UpdateL3(Level3{14, level3::Modify{1003, true, 4, 101.5}});
+    ob.UpdateL3(Level3{15, level3::Execute{1003, true, 1}});
+    ob.UpdateL3(Level3{16, level3::Modify{4242, false, 2, 107.0}});
+    checker.FullSweep(ob);
+    EXPECT_EQ(checker.Total(), 0u);
+    EXPECT_EQ(m.ob, R"(BID:
+102.000000:[7@1004]
+101.500000:[3@1003]
+100.000000:[10@1001]
+ASK:
+103.000000:[10@1005]
+104.000000:[10@1006]
+105.000000:[10@1007]
+106.000000:[10@1008]
+107.000000:[2@4242]
+)");
+    ob.UpdateL3(Level3{17, level3::Cancel{1003, true}});
+    EXPECT_EQ(ob.FindLevel(true, 101.5), nullptr);
+}
+
+TEST(Modify, UnknownOrderToZeroIsNoop) {
+    SmartObCallback nop;
+    SmartL3Book ob(&nop);
+    InvariantChecker checker;
+    ob.AddObserver(&checker);
+    ob.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    ob.UpdateL3(Level3{2, level3::Modify{4242, true, 0, 99.0}});
+    ob.UpdateL3(Level3{3, level3::Modify{4243, false, 0, 101.0}});
+    checker.FullSweep(ob);
+    EXPECT_EQ(checker.Total(), 0u);
+    EXPECT_EQ(ob.FindLevel(true, 99.0), nullptr);
+    EXPECT_EQ(ob.FindLevel(false, 101.0), nullptr);
+    EXPECT_TRUE(ob.TouchedLevels().empty());
+    EXPECT_EQ(ob.ToString(), "BID:\n100.000000:[10@1]\nASK:\n");
+}
+
+NamedEngine FuzzEngine(std::string name, const SoaKernels &kernels,
+                       ModifyPriority priority = ModifyPriority::LoseAlways) {
+    return NamedEngine{name, [&kernels, priority] {
+                           return std::make_unique<SmartBookEngine<>>(
+                               [&kernels, priority](SmartL3Book &book) {
+                                   book.SetSoaKernels(kernels);
+                                   book.SetModifyPriority(priority);
+                               });
+                       }};
+}
+
+// an engine made with Engine(args...)
+template <typename Engine = SmartBookEngine<>, typename... Args>
+NamedEngine MakeEngine(std::string name, Args... args) {
+    return NamedEngine{name, [args...] {
+                           return std::make_unique<Engine>(args...);
+                       }};
+}
+
+// the candidate renders the same books and reports the same callbacks as
+// the reference on 10 workloads of 500 events
+void ExpectSameAs(const NamedEngine &reference, const NamedEngine &candidate,
+                  FuzzConfig config = {}) {
+    config.num_events = 500;
+    auto report = RunFuzz(config, 10, reference, {candidate});
+    EXPECT_FALSE(report.failed) << candidate.name << " vs " << reference.name
+                                << "\n"
+                                << report.mismatch.expected << "\n"
+                                << report.mismatch.actual;
+}
+
+TEST(Fuzz, FormatMessageRoundTrip) {
+    FuzzConfig config;
+    config.num_events = 200;
+    auto msgs = GenerateWorkload(config);
+    EXPECT_TRUE(IsValidWorkload(msgs));
+    for (const auto &msg : msgs) {
+        StreamMsg parsed;
+        ASSERT_TRUE(ParseMessage(FormatMessage(msg), parsed));
+        EXPECT_EQ(FormatMessage(parsed), FormatMessage(msg));
+    }
+}
+
+TEST(Fuzz, KernelsMatchScalar) {
+    FuzzConfig config;
+    config.num_events = 500;
+    auto report = RunFuzz(config, 20, FuzzEngine("scalar", ScalarKernels()),
+                          {FuzzEngine("runtime", GetSoaKernels())});
+    EXPECT_FALSE(report.failed) << report.mismatch.expected << "\n"
+                                << report.mismatch.actual;
+    EXPECT_EQ(report.workloads, 20u);
+    ASSERT_EQ(report.throughput.size(), 2u);
+    EXPECT_GT(report.throughput[1].msgs_per_sec, 0);
+}
+
+TEST(Fuzz, ShrinksMismatch) {
+    // keeping priority on a same price modify changes the estimated orders
+    FuzzConfig config;
+    config.num_events = 500;
+    auto report = RunFuzz(
+        config, 20, FuzzEngine("lose", ScalarKernels()),
+        {FuzzEngine("keep", ScalarKernels(), ModifyPriority::KeepAlways)});
+    ASSERT_TRUE(report.failed);
+    EXPECT_EQ(report.mismatch.engine, "keep");
+    EXPECT_TRUE(IsValidWorkload(report.repro));
+    // two orders at one price and the modify of the first
+    EXPECT_LE(report.repro.size(), 4u);
+    EXPECT_EQ(report.mismatch.index + 1, report.repro.size());
+}
+
+static_assert(sizeof(L3SmartPriceLevelT<L3OnlyPolicy>) == sizeof(L3PriceLevel));
+static_assert(sizeof(L3SmartPriceLevel) > sizeof(L3PriceLevel));
+static_assert(sizeof(SmartL3BookT<L3OnlyPolicy>) < sizeof(SmartL3Book));
+// no kernels, diff scratch or cross stream seq_ids, only the callback,
+// observers, touched levels, frozen form, the current and L3 seq_id
+static_assert(sizeof(SmartL3BookT<L3OnlyPolicy>) ==
+              sizeof(L3BookImpl<L3SmartPriceLevelT<L3OnlyPolicy>>) +
+                  sizeof(void *) + 2 * sizeof(std::vector<void *>) +
+                  sizeof(std::unique_ptr<FrozenBook>) + 2 * sizeof(int));
+
+template <typename Book>
+concept AcceptsSoaKernels =
+    requires(Book &b, const SoaKernels &k) { b.SetSoaKernels(k); };
+
+static_assert(AcceptsSoaKernels<SmartL3Book>);
+static_assert(!AcceptsSoaKernels<SmartL3BookT<L3OnlyPolicy>>);
+
+TEST(Policy, L3OnlyMatchesFullBook) {
+    // without snapshots and trades the full book shows the L3 orders as is
+    FuzzConfig config;
+    config.l2_stream = false;
+    config.trade_stream = false;
+    ExpectSameAs(
+        MakeEngine("full"),
+        MakeEngine<SmartBookEngine<SmartL3BookT<L3OnlyPolicy>>>("l3_only"),
+        config);
+}
+
+struct NoAddPolicy : FullBookPolicy {
+    static constexpr bool kOnOrderAdd = false;
+};
+
+TEST(Policy, DisabledCallbacks) {
+    using Book = SmartL3BookT<NoAddPolicy>;
+    CallbackRecorder<Book> recorder;
+    Book ob(&recorder);
+    ob.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    ob.UpdateL3(Level3{2, level3::Add{2, true, 10, 100.0}});
+    ob.UpdateL2(Snapshot{3, {{100.0, 25}}, {}});
+    ob.UpdateL3(Level3{4, level3::Cancel{1, true}});
+    ASSERT_EQ(recorder.events.size(), 1u);
+    EXPECT_EQ(recorder.events[0].kind, 'C');
+    EXPECT_EQ(ob.ToString(), "BID:\n100.000000:[10@2]\nASK:\n");
+}
+
+struct NoTradePolicy : FullBookPolicy {
+    static constexpr bool kTradeInference = false;
+};
+
+template <typename Book>
+concept AcceptsTrades = requires(Book &b, const Trade &t) { b.UpdateTrade(t); };
+
+static_assert(AcceptsTrades<SmartL3Book>);
+static_assert(!AcceptsTrades<SmartL3BookT<NoTradePolicy>>);
+
+TEST(Policy, L2WithoutTradesReportsCancels) {
+    using Book = SmartL3BookT<NoTradePolicy>;
+    CallbackRecorder<Book> recorder;
+    Book ob(&recorder);
+    ob.UpdateL2(Snapshot{1, {{100.0, 20}}, {{101.0, 5}}});
+    ob.UpdateL2(Snapshot{2, {{100.0, 10}}, {{101.0, 5}}});
+    ASSERT_EQ(recorder.events.size(), 3u);
+    EXPECT_EQ(recorder.events[2].kind, 'C');
+    EXPECT_EQ(recorder.events[2].info.size, 10);
+    EXPECT_EQ(ob.ToString(),
+              "BID:\n100.000000:[10@0]\nASK:\n101.000000:[5@0]\n");
+}
+
+// the feed handler builds for books without some of its streams
+template struct UdpFeedHandler<SmartL3BookT<L3OnlyPolicy>>;
+template struct UdpFeedHandler<SmartL3BookT<L2TradePolicy>>;
+
+TEST(Policy, ReadersOfL3OnlyBook) {
+    using Book = SmartL3BookT<L3OnlyPolicy>;
+    auto journal = std::make_unique<EventJournal<64>>();
+    JournalCallback<64, Book> cb(*journal);
+    JournalReader reader(*journal);
+    Book ob(&cb), other(&cb);
+    InvariantCheckerT<Book> checker(1);
+    BookHistoryT<Book> history(2);
+    ConsolidatedBookT<Book> consolidated(2);
+    ob.AddObserver(&checker);
+    history.Attach(ob);
+    other.UpdateL3(Level3{1, level3::Add{9, false, 4, 101.0}});
+    ASSERT_TRUE(consolidated.Attach(0, ob));
+    ASSERT_TRUE(consolidated.Attach(1, other));
+
+    ob.UpdateL3(Level3{2, level3::Add{1, true, 10, 100.0}});
+    ob.UpdateL3(Level3{3, level3::Add{2, false, 5, 101.0}});
+    ob.UpdateL3(Level3{4, level3::Execute{1, true, 3}});
+    EXPECT_EQ(checker.Total(), 0u);
+    EXPECT_EQ(checker.sweeps, 3u);
+
+    HistoricalBook past;
+    ASSERT_TRUE(history.AsOf(4, past));
+    EXPECT_EQ(past.ToString(), ob.ToString());
+    ASSERT_TRUE(history.AsOf(2, past));
+    EXPECT_EQ(past.ToString(), "BID:\n100.000000:[10@1]\nASK:\n");
+
+    EXPECT_EQ(consolidated.Bbo().bid_qty, 7);
+    EXPECT_EQ(consolidated.Bbo().ask_qty, 9);
+
+    DepthSnapshot depth;
+    CaptureDepth(ob, 5, depth);
+    ASSERT_EQ(depth.sides[0].size(), 1u);
+    EXPECT_EQ(depth.sides[0][0].qty, 7);
+
+    size_t events = 0;
+    reader.Poll([&](const JournalEvent &) { events++; });
+    EXPECT_EQ(events, 4u);
+}
+
+TEST(LevelRecycling, ReusesRemovedLevel) {
+    SmartObCallback nop;
+    SmartL3Book ob(&nop);
+    ob.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    ob.UpdateTrade(Trade{2, true, 100.0, 4});
+    auto *level = ob.FindLevel(true, 100.0);
+    ASSERT_NE(level, nullptr);
+    ob.UpdateL3(Level3{2, level3::Execute{1, true, 4}});
+    ob.UpdateL3(Level3{3, level3::Cancel{1, true}});
+    EXPECT_EQ(ob.FindLevel(true, 100.0), nullptr);
+    EXPECT_EQ(ob.ToString(), "BID:\nASK:\n");
+
+    // the node comes back for another price and side, empty
+    ob.UpdateL3(Level3{4, level3::Add{2, false, 5, 101.0}});
+    EXPECT_EQ(ob.FindLevel(false, 101.0), level);
+    EXPECT_FALSE(level->is_bid);
+    EXPECT_EQ(level->numOrders, 1);
+    EXPECT_EQ(level->total_unconfirmed_trade_qty, 0);
+    EXPECT_TRUE(level->unconfirmed_trades.empty());
+    EXPECT_EQ(ob.ToString(), "BID:\nASK:\n101.000000:[5@2]\n");
+}
+
+TEST(LevelRecycling, InvisibleToConsumers) {
+    auto recycling = [](size_t n) {
+        return [n](SmartL3Book &book) { book.SetLevelRecycling(n); };
+    };
+    ExpectSameAs(MakeEngine("no_recycling", recycling(0)),
+                 MakeEngine("recycling", recycling(4)));
+}
+
+// hibernates after every message, so every render is served from the frozen
+// form and every update thaws it
+struct HibernatingEngine : SmartBookEngine<> {
+    void Apply(const StreamMsg &msg) override {
+        SmartBookEngine::Apply(msg);
+        book.Hibernate();
+    }
+};
+
+TEST(Hibernation, FrozenMatchesLive) {
+    ExpectSameAs(MakeEngine("live"),
+                 MakeEngine<HibernatingEngine>("hibernating"));
+}
+
+TEST(Hibernation, QueriesAndThaw) {
+    Mock m, twin_m;
+    SmartL3Book ob(&m), twin(&twin_m);
+    setup(m, ob);
+    setup(twin_m, twin);
+    ob.UpdateTrade(Trade{14, true, 102.0, 2});
+    twin.UpdateTrade(Trade{14, true, 102.0, 2});
+    auto live = ob.ToString();
+    auto live_bytes = ob.MemoryUsage();
+
+    auto reclaimed = ob.Hibernate();
+    EXPECT_TRUE(ob.Hibernated());
+    EXPECT_GT(reclaimed, 0u);
+    EXPECT_EQ(ob.MemoryUsage(), live_bytes - reclaimed);
+    EXPECT_LT(ob.MemoryUsage(), live_bytes / 4);
+    EXPECT_EQ(ob.Hibernate(), 0u);
+    EXPECT_EQ(ob.ToString(), live);
+
+    const auto *frozen = ob.Frozen();
+    ASSERT_NE(frozen, nullptr);
+    EXPECT_EQ(frozen->num_bids, 3u);
+    EXPECT_EQ(frozen->FindLevel(false, 102.0), nullptr);
+    const auto *level = frozen->FindLevel(true, 102.0);
+    ASSERT_NE(level, nullptr);
+    EXPECT_EQ(level->unconfirmed_trade_qty, 2);
+    EXPECT_EQ(ob.FrozenEstimatedQty(*level), 5);
+    std::vector<Order> orders;
+    ob.ForEachFrozenOrder(*level, true,
+                          [&](const Order &o) { orders.push_back(o); });
+    ASSERT_EQ(orders.size(), 1u);
+    EXPECT_EQ(orders[0].orderId, 1004);
+    EXPECT_EQ(orders[0].size, 5);
+    EXPECT_NE(frozen->FindLevel(false, 106.0), nullptr);
+
+    // the next update thaws the book
+    ob.UpdateL3(Level3{15, level3::Add{1009, false, 4, 103.0}});
+    twin.UpdateL3(Level3{15, level3::Add{1009, false, 4, 103.0}});
+    EXPECT_FALSE(ob.Hibernated());
+    EXPECT_EQ(ob.ToString(), twin.ToString());
+    EXPECT_EQ(m.infos.size(), twin_m.infos.size());
+    EXPECT_EQ(ob.FindLevel(true, 102.0)->total_unconfirmed_trade_qty, 2);
+    EXPECT_EQ(ob.FindLevel(false, 103.0)->numOrders, 2);
+}
+
+TEST(Hibernation, ReadersStayFrozen) {
+    Mock m, twin_m;
+    SmartL3Book ob(&m), twin(&twin_m);
+    setup(m, ob);
+    setup(twin_m, twin);
+    ob.UpdateTrade(Trade{14, true, 102.0, 2});
+    twin.UpdateTrade(Trade{14, true, 102.0, 2});
+    ob.Hibernate();
+
+    DepthSnapshot depth, twin_depth;
+    CaptureDepth(ob, 5, depth);
+    CaptureDepth(twin, 5, twin_depth);
+    for (int s = 0; s < 2; s++) {
+        ASSERT_EQ(depth.sides[s].size(), twin_depth.sides[s].size());
+        for (size_t i = 0; i < depth.sides[s].size(); i++) {
+            EXPECT_EQ(depth.sides[s][i].ticks, twin_depth.sides[s][i].ticks);
+            EXPECT_EQ(depth.sides[s][i].qty, twin_depth.sides[s][i].qty);
+            EXPECT_EQ(depth.sides[s][i].num_orders,
+                      twin_depth.sides[s][i].num_orders);
+        }
+    }
+
+    BookHistory history, twin_history;
+    history.Attach(ob);
+    twin_history.Attach(twin);
+    HistoricalBook past, twin_past;
+    ASSERT_TRUE(history.AsOf(14, past));
+    ASSERT_TRUE(twin_history.AsOf(14, twin_past));
+    EXPECT_EQ(past.ToString(), twin_past.ToString());
+
+    EXPECT_EQ(ob.FindLevel(true, 102.0), nullptr);
+    auto level = ob.FindLevelView(true, 102.0);
+    auto twin_level = twin.FindLevelView(true, 102.0);
+    ASSERT_TRUE(level && twin_level);
+    EXPECT_EQ(level->EstimatedQty(), twin_level->EstimatedQty());
+    std::string orders, twin_orders;
+    AppendLevel(orders, level->price,
+                [&](auto &&f) { level->ForEachOrder(f); });
+    AppendLevel(twin_orders, twin_level->price,
+                [&](auto &&f) { twin_level->ForEachOrder(f); });
+    EXPECT_EQ(orders, twin_orders);
+    EXPECT_FALSE(ob.FindLevelView(true, 101.0));
+    ob.DebugCheck();
+
+    InvariantChecker checker;
+    checker.FullSweep(ob);
+    EXPECT_EQ(checker.frozen_sweeps, 1u);
+    EXPECT_EQ(checker.Total(), 0u);
+    EXPECT_TRUE(ob.Hibernated());
+
+    // a cancel of an order the book does not have changes nothing
+    ob.UpdateL3(Level3{15, level3::Cancel{4242, true}});
+    twin.UpdateL3(Level3{15, level3::Cancel{4242, true}});
+    EXPECT_TRUE(ob.Hibernated());
+    EXPECT_EQ(m.infos.size(), twin_m.infos.size());
+
+    ob.UpdateL3(Level3{16, level3::Cancel{1001, true}});
+    twin.UpdateL3(Level3{16, level3::Cancel{1001, true}});
+    EXPECT_FALSE(ob.Hibernated());
+    EXPECT_EQ(ob.ToString(), twin.ToString());
+    ASSERT_TRUE(history.AsOf(16, past));
+    ASSERT_TRUE(twin_history.AsOf(16, twin_past));
+    EXPECT_EQ(past.ToString(), twin_past.ToString());
+}
+
+TEST(Hibernation, ManagerIdleInterval) {
+    SmartObCallback nop;
+    SmartL3Book busy(&nop), quiet(&nop);
+    busy.UpdateL3(Level3{1, level3::Add{1, true, 10, 100.0}});
+    quiet.UpdateL3(Level3{1, level3::Add{1, false, 10, 101.0}});
+
+    HibernationManager<> manager(100);
+    manager.Add(busy);
+    manager.Add(quiet);
+    manager.Tick(1000);
+    for (int t = 1; t <= 3; t++) {
+        busy.UpdateL3(Level3{1 + t, level3::Add{1 + t, true, 1, 100.0}});
+        manager.Tick(1000 + 60 * t);
+    }
+    EXPECT_FALSE(busy.Hibernated());
+    EXPECT_TRUE(quiet.Hibernated());
+    auto stats = manager.Stats();
+    EXPECT_EQ(stats.hibernations, 1u);
+    EXPECT_EQ(stats.hibernated, 1u);
+    EXPECT_GT(stats.bytes_reclaimed, 0u);
+
+    quiet.UpdateL3(Level3{2, level3::Cancel{1, false}});
+    EXPECT_FALSE(quiet.Hibernated());
+    manager.Tick(1250);
+    stats = manager.Stats();
+    EXPECT_EQ(stats.thaws, 1u);
+    EXPECT_EQ(stats.hibernated, 0u);
+    EXPECT_EQ(stats.bytes_reclaimed, 0u);
+    EXPECT_GT(stats.total_bytes_reclaimed, 0u);
+    // busy is idle since the 1180 tick, quiet since the 1250 one
+    manager.Tick(1300);
+    EXPECT_TRUE(busy.Hibernated());
+    EXPECT_FALSE(quiet.Hibernated());
+    EXPECT_EQ(manager.Stats().hibernations, 2u);
+}